@@ -19,23 +19,43 @@
 
 /* TODO:
   - dns lookup for collector
-  - source ip spoof
-  - step support in range expression
   - absolute value for firstseen and last seen
 */
 
+#define _GNU_SOURCE	/* sendmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <poll.h>
+
+#if defined (__linux__)
+#include <sys/syscall.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#endif
 
 #include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "netflow.h"
 
@@ -61,11 +81,128 @@
 #define OPT_DSTAS	19
 #define OPT_SRCMASK	20
 #define OPT_DSTMASK	21
+#define OPT_NOGSO	22
+#define OPT_CPU		23
+#define OPT_SPIN	24
+#define OPT_NOSIMD	25
+#define OPT_POOL	26
+#define OPT_PCAPOUT	27
+#define OPT_FIELDS	28
+#define OPT_TMPLREFRESH	29
+#define OPT_MTU		30
+#define OPT_TCP		31
+#define OPT_EXPORTERS	32
+#define OPT_EXPRATE	33
+#define OPT_PACKET	34
+#define OPT_QDISCBYPASS	35
+#define OPT_DSTMAC	36
+#define OPT_URING	37
+#define OPT_BENCH	38
+#define OPT_STATS	39
+#define OPT_JSON	40
+#define OPT_COARSECLOCK	41
+#define OPT_FLOWCACHE	42
+#define OPT_NEWFLOWS	43
+#define OPT_ACTIVE	44
+#define OPT_INACTIVE	45
+#define OPT_SCENARIO	46
+#define OPT_TIMEWARP	47
+#define OPT_STARTTIME	48
+#define OPT_LISTEN	49
+#define OPT_PCAPIN	50
+#define OPT_PCAPSPEED	51
+#define OPT_RATEPROF	52
+#define OPT_SWEEP	53
+#define OPT_SWEEPSTEP	54
+#define OPT_SWEEPHOLD	55
+#define OPT_SWEEPOUT	56
 
-struct flow_exporter Ex;
+struct flow_exporter *Ex;	/* one per worker thread */
+struct flow_listener *Lx;	/* or per receiver thread, with --listen */
+int nworkers = 1;
 
 int debug = 0;
 int nosend_f = FALSE;
+volatile sig_atomic_t stop_f = FALSE;
+
+/* flow profiles mixed by weight, read again on SIGHUP */
+char *scenario_file = NULL;
+struct flow_exprs scenario_fx;	/* for the fields a profile does not give */
+volatile sig_atomic_t reload_f = FALSE;
+
+/*
+ * While set, fatal() returns there rather than exiting. It is of the
+ * thread which set it, so the workers still exit.
+ */
+__thread jmp_buf *fatal_jmp;
+
+/* every worker draws random numbers from its own xoshiro256** stream */
+__thread u_int64_t rng_s[4];
+u_int64_t rng_seed;
+
+int nf_version = NF_VERSION_V5;
+int mtu = ETH_MTU;	/* PDUs are cut to fit in IP packets this long */
+int tcp_f = FALSE;	/* IPFIX over TCP rather than UDP */
+int json_f = FALSE;	/* stats are printed as JSON lines */
+
+/* record layout and V9 template FlowSet, the same for all the workers */
+struct rec_layout layout;
+u_int8_t tset[MAX_TSETLEN];
+int tset_len = 0;
+
+/* the template is sent again every this many PDUs, or nanoseconds */
+long tmpl_refresh_pdus = 20;
+u_int64_t tmpl_refresh_ns = 0;
+
+/* flowrec-option behind each field, and how V9 exports it */
+struct {
+  const char *name;
+  size_t expr;		/* offset in struct flow_exprs */
+  int addr;		/* ipaddr_expr_t rather than val_expr_t */
+  int type;		/* V9 field type */
+  int width;		/* V9 field length */
+} fields[NUM_FIELDS] = {
+  { "srcaddr",   offsetof(struct flow_exprs, srcaddr),   TRUE,
+    NF9_IPV4_SRC_ADDR,  4 },
+  { "dstaddr",   offsetof(struct flow_exprs, dstaddr),   TRUE,
+    NF9_IPV4_DST_ADDR,  4 },
+  { "nexthop",   offsetof(struct flow_exprs, nexthop),   TRUE,
+    NF9_IPV4_NEXT_HOP,  4 },
+  { "inputif",   offsetof(struct flow_exprs, in_if),     FALSE,
+    NF9_INPUT_SNMP,     2 },
+  { "outputif",  offsetof(struct flow_exprs, out_if),    FALSE,
+    NF9_OUTPUT_SNMP,    2 },
+  { "packets",   offsetof(struct flow_exprs, packets),   FALSE,
+    NF9_IN_PKTS,        4 },
+  { "octets",    offsetof(struct flow_exprs, octets),    FALSE,
+    NF9_IN_BYTES,       4 },
+  { "firstseen", offsetof(struct flow_exprs, first),     FALSE,
+    NF9_FIRST_SWITCHED, 4 },
+  { "lastseen",  offsetof(struct flow_exprs, last),      FALSE,
+    NF9_LAST_SWITCHED,  4 },
+  { "srcport",   offsetof(struct flow_exprs, src_port),  FALSE,
+    NF9_L4_SRC_PORT,    2 },
+  { "dstport",   offsetof(struct flow_exprs, dst_port),  FALSE,
+    NF9_L4_DST_PORT,    2 },
+  { "tcpflags",  offsetof(struct flow_exprs, tcp_flags), FALSE,
+    NF9_TCP_FLAGS,      1 },
+  { "protocol",  offsetof(struct flow_exprs, proto),     FALSE,
+    NF9_PROTOCOL,       1 },
+  { "tos",       offsetof(struct flow_exprs, tos),       FALSE,
+    NF9_SRC_TOS,        1 },
+  { "srcas",     offsetof(struct flow_exprs, src_as),    FALSE,
+    NF9_SRC_AS,         2 },
+  { "dstas",     offsetof(struct flow_exprs, dst_as),    FALSE,
+    NF9_DST_AS,         2 },
+  { "srcmask",   offsetof(struct flow_exprs, src_mask),  FALSE,
+    NF9_SRC_MASK,       1 },
+  { "dstmask",   offsetof(struct flow_exprs, dst_mask),  FALSE,
+    NF9_DST_MASK,       1 },
+};
+
+#define V5_FIELD(f, m) \
+  lay->off[f] = offsetof(struct nf_v5_rec, m); \
+  lay->width[f] = sizeof(((struct nf_v5_rec *)0)->m)
 
 void usage(void)
 {
@@ -74,10 +211,50 @@ void usage(void)
  options:\n\
    -n, --count <num>\n\
    -p, --port <num>\n\
-   -V, --version <version>\n\
+   -s, --spoof <src ip address>\n\
+   -V, --version <5|9|10>\n\
+   --fields <field,...>\n\
+   --template-refresh <# of packets>|<sec>s\n\
+   --mtu <octets>\n\
+   --tcp\n\
    -f, --flowrec <# of flow records in packet>\n\
+   -b, --batch <# of packets sent at once>\n\
+   -r, --rate <rate>[k|m|g][fps|pps|bps]\n\
+   --rate-profile <sec=rate,...[,loop]>|sine(<sec>,<min>,<max>)|<file>\n\
+   --spin <usec>\n\
+   -T, --threads <# of worker threads>\n\
+   -S, --seed <random seed>\n\
+   --nosimd\n\
+   --cpu <cpu number>\n\
+   --nogso\n\
+   --coarse-clock\n\
+   --time-warp <speed-up factor>\n\
+   --start-time <YYYY-MM-DDTHH:MM:SS or seconds since the epoch>\n\
+   --uring\n\
    -d, --debug <debug level>\n\
    -N, --nosend\n\
+   --pool <# of packets pre-rendered and replayed>\n\
+   --pcap-out <file>\n\
+   --pcap-in <file>\n\
+   --pcap-speed <factor of the original timing, 0 = max>\n\
+   --packet <interface>\n\
+   --qdisc-bypass\n\
+   --dst-mac <xx:xx:xx:xx:xx:xx>\n\
+   --exporters <# of virtual exporters>\n\
+   --exporter-rate <flows/sec of each exporter>\n\
+   --flow-cache <# of concurrent flows>\n\
+   --new-flows <flows/sec>\n\
+   --active-timeout <sec>\n\
+   --inactive-timeout <sec>\n\
+   --scenario <file>\n\
+   --bench <file>\n\
+   --sweep <start rate>[k|m|g][fps|pps|bps]\n\
+   --sweep-step <factor of each step>\n\
+   --sweep-hold <sec of each step>\n\
+   --sweep-out <csv file>\n\
+   --stats <sec>\n\
+   --json\n\
+   --listen\n\
    -h, --help\n\
  flowrec-options:\n\
    -w, --wait <wait time>\n\
@@ -105,18 +282,188 @@ void usage(void)
   Numbers can be expressed using the following meta characters:\n\
     111      (static)\n\
     111-222  (sequential)\n\
+    111-222/3  (sequential, step 3)\n\
     111:222  (random)\n\
-    100@70,200@20,300@10   (probabilistic)\n");
+    100@70,200@20,300@10   (probabilistic)\n\
+    100@0.5,200@99.5       (probabilistic, any weights)\n\
+    zipf(1000,1.2)         (Zipf over 1-1000, 1 most frequent)\n\
+    zipf(1000,1.2,1024)    (Zipf over 1024-2023)\n\
+    pareto(300,1.5)        (Pareto, minimum and shape)\n\
+    lognormal(8,1.5)       (lognormal, mu and sigma)\n\
+  IPv4 addresses can also be expressed as a whole:\n\
+    10.0.0.0/8   (sequential over the prefix)\n\
+    :10.0.0.0/8  (random over the prefix)\n\
+    10.0.0.1-10.0.255.254/2  (sequential, step 2)\n\
+    10.0.0.1:10.0.255.254    (random)\n\
+    zipf(10.0.0.0/16,1.2)    (Zipf over the prefix, 10.0.0.0 most frequent)\n");
   exit(1);
 }
 
 void fatal(const char *msg)
 {
   printf("%s\n", msg);
+  if (fatal_jmp)
+    longjmp(*fatal_jmp, 1);
   exit(1);
 }
 
 
+static inline u_int64_t rotl(u_int64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * xoshiro256** by David Blackman and Sebastiano Vigna
+ */
+static inline u_int64_t rng_next(void)
+{
+  u_int64_t r = rotl(rng_s[1] * 5, 7) * 9;
+  u_int64_t t = rng_s[1] << 17;
+
+  rng_s[2] ^= rng_s[0];
+  rng_s[3] ^= rng_s[1];
+  rng_s[1] ^= rng_s[2];
+  rng_s[0] ^= rng_s[3];
+  rng_s[2] ^= t;
+  rng_s[3] = rotl(rng_s[3], 45);
+
+  return r;
+}
+
+/*
+ * Returns a random number in [0, n), n <= 2^64 - 1, without division.
+ */
+static inline u_int64_t rng_range(u_int64_t n)
+{
+  return (u_int64_t)(((unsigned __int128)rng_next() * n) >> 64);
+}
+
+/*
+ * Seeds the calling thread's generator for the given stream. Every
+ * stream starts 2^128 numbers apart from the previous one, so that the
+ * streams of workers never overlap.
+ */
+void rng_init(u_int64_t seed, int stream)
+{
+  static const u_int64_t jump[] = {
+    0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+    0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+  };
+  u_int64_t s[4];
+  int i, b;
+
+  /* splitmix64 expands the seed into the initial state */
+  for (i=0; i<4; i++) {
+    u_int64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng_s[i] = z ^ (z >> 31);
+  }
+
+  while (stream-- > 0) {
+    memset(s, 0, sizeof(s));
+    for (i=0; i<4; i++)
+      for (b=0; b<64; b++) {
+	if (jump[i] & (1ULL << b)) {
+	  s[0] ^= rng_s[0];
+	  s[1] ^= rng_s[1];
+	  s[2] ^= rng_s[2];
+	  s[3] ^= rng_s[3];
+	}
+	rng_next();
+      }
+    memcpy(rng_s, s, sizeof(s));
+  }
+}
+
+
+/*
+ * Builds the alias table (Vose's method) of n values with the given
+ * weights, so that a value can be drawn with one random number.
+ */
+void build_alias(val_expr_t *e, const double *weight, int n)
+{
+  double *p, sum = 0;
+  int *small, *large, ns = 0, nl = 0, i;
+
+  for (i=0; i<n; i++)
+    sum += weight[i];
+  if (sum <= 0)
+    fatal("invalid probability");
+
+  e->prob = malloc(sizeof(u_int64_t) * n);
+  e->alias = malloc(sizeof(u_int32_t) * n);
+  p = malloc(sizeof(double) * n);
+  small = malloc(sizeof(int) * n);
+  large = malloc(sizeof(int) * n);
+  if (!e->prob || !e->alias || !p || !small || !large)
+    fatal("out of memory");
+
+  for (i=0; i<n; i++) {
+    p[i] = weight[i] * n / sum;
+    if (p[i] < 1.0)
+      small[ns++] = i;
+    else
+      large[nl++] = i;
+  }
+
+  while (ns && nl) {
+    int l = small[--ns];
+    int g = large[--nl];
+
+    e->prob[l] = (u_int64_t)(p[l] * 4294967296.0);
+    e->alias[l] = g;
+    p[g] -= 1.0 - p[l];
+    if (p[g] < 1.0)
+      small[ns++] = g;
+    else
+      large[nl++] = g;
+  }
+  /* what is left over has a probability of 1 (modulo rounding) */
+  while (nl) {
+    i = large[--nl];
+    e->prob[i] = 1ULL << 32;
+    e->alias[i] = i;
+  }
+  while (ns) {
+    i = small[--ns];
+    e->prob[i] = 1ULL << 32;
+    e->alias[i] = i;
+  }
+
+  free(p);
+  free(small);
+  free(large);
+}
+
+
+/*
+ * Zipf distribution over n ranks from start on: the k-th one is drawn
+ * with a probability in proportion to 1/k^s, through an alias table.
+ */
+void compile_zipf(val_expr_t *e, long n, double s, long start)
+{
+  double *weight;
+  long k;
+
+  if (n < 1 || n > ZIPF_MAX || s < 0)
+    fatal("invalid zipf expression");
+  if ((weight = malloc(sizeof(double) * n)) == NULL)
+    fatal("out of memory");
+  for (k=0; k<n; k++)
+    weight[k] = pow(k + 1, -s);
+
+  e->mode = EXPR_TYPE_ZIPF;
+  e->nvals = n;
+  e->vals = NULL;
+  build_alias(e, weight, n);
+  free(weight);
+  e->start = e->cur = start;
+  e->end = start + n - 1;
+  e->step = 0;
+}
+
 void compile_expr(const char *str, val_expr_t *e)
 {
 
@@ -125,10 +472,46 @@ void compile_expr(const char *str, val_expr_t *e)
   [Examples]
   111      (static)
   111-222  (sequential)
+  111-222/3  (sequential, step 3)
   111:222  (random)
   100@70,200@20,300@10   (probabilistic)
+  zipf(1000,1.2)     (Zipf, 1 to 1000)
+  zipf(1000,1.2,1024)  (Zipf, 1024 to 2023)
+  pareto(300,1.5)    (Pareto, xm and alpha)
+  lognormal(8,1.5)   (lognormal, mu and sigma)
 
   */
+  memset(e, 0, sizeof(*e));
+
+  if (!strncmp(str, "zipf(", 5)) {
+    long n, start = 1;
+    double s;
+
+    if (sscanf(str, "zipf(%ld,%lf,%ld)", &n, &s, &start) < 2 ||
+	!strchr(str, ')'))
+      fatal("invalid zipf expression");
+    compile_zipf(e, n, s, start);
+    return;
+  }
+
+  if (!strncmp(str, "pareto(", 7)) {
+    e->mode = EXPR_TYPE_PARETO;
+    if (sscanf(str, "pareto(%lf,%lf)", &e->p1, &e->p2) != 2 ||
+	!strchr(str, ')') || e->p1 <= 0 || e->p2 <= 0)
+      fatal("invalid pareto expression");
+    e->p2 = -1.0 / e->p2;
+    e->start = e->end = e->step = e->cur = 0;
+    return;
+  }
+
+  if (!strncmp(str, "lognormal(", 10)) {
+    e->mode = EXPR_TYPE_LOGNORM;
+    if (sscanf(str, "lognormal(%lf,%lf)", &e->p1, &e->p2) != 2 ||
+	!strchr(str, ')') || e->p2 < 0)
+      fatal("invalid lognormal expression");
+    e->start = e->end = e->step = e->cur = 0;
+    return;
+  }
 
   if (!strchr(str, '-') && !strchr(str, ':') && !strchr(str, '@')) {
     e->mode = EXPR_TYPE_SEQ;
@@ -140,8 +523,10 @@ void compile_expr(const char *str, val_expr_t *e)
 
   if (strchr(str, '-')) {
     e->mode = EXPR_TYPE_SEQ;
-    sscanf(str, "%ld-%ld", &e->start, &e->end);
     e->step = 1;
+    sscanf(str, "%ld-%ld/%ld", &e->start, &e->end, &e->step);
+    if (e->step < 1)
+      fatal("invalid step");
     e->cur = e->start;
     return;
   }
@@ -156,26 +541,39 @@ void compile_expr(const char *str, val_expr_t *e)
 
   if (strchr(str, '@')) {
     const char *s = str;
-    const char *c;
-    long val;
-    int  p, psum = 0;
+    double *weight;
+    int n = 1;
+
+    for (s = str; *s; s++)
+      if (*s == ',')
+	n++;
+    e->vals = malloc(sizeof(long) * n);
+    weight = malloc(sizeof(double) * n);
+    if (!e->vals || !weight)
+      fatal("out of memory");
 
     e->mode = EXPR_TYPE_PRB;
+    e->nvals = 0;
+    s = str;
     while (*s) {
-      int i;
-      sscanf(s, "%ld@%d", &val, &p);
-      if (p + psum > 100)
-	break;
-      for (i=0; i< p; i++) {
-	e->vals[psum + i] = val;
+      if (sscanf(s, "%ld@%lf", &e->vals[e->nvals], &weight[e->nvals]) != 2 ||
+	  weight[e->nvals] < 0) {
+	free(weight);
+	fatal("invalid probabilistic expression");
       }
-      psum += p;
-      c = strchr(s, ',');	/* XXX: consider case where s ends with ','! */
-      if (c)
-	s = c + 1;
-      else
+      e->nvals++;
+      if ((s = strchr(s, ',')) == NULL)
 	break;
+      s++;
+    }
+    for (n=0; n < e->nvals && weight[n] == 0; n++)
+      ;
+    if (n == e->nvals) {
+      free(weight);
+      fatal("invalid probability");
     }
+    build_alias(e, weight, e->nvals);
+    free(weight);
     e->start = e->end = e->step = e->cur = 0; /* XXX */
     return;
   }
@@ -185,266 +583,4600 @@ void compile_expr(const char *str, val_expr_t *e)
 }
 
 
-void compile_ipaddr_expr(const char *str, ipaddr_expr_t *ie)
-{
-  char buf[256];	/* XXX */
-  val_expr_t octet;
-  const char *p = str;
-  int i;
+/*
+ * Parses a dotted-quad address at str into *addr (host byte order) and
+ * returns a pointer to the first character after it, or NULL.
+ */
+const char *parse_ipaddr(const char *str, u_int32_t *addr)
+{
+  unsigned int o[4];
+  int len;
+
+  if (sscanf(str, "%u.%u.%u.%u%n", &o[0], &o[1], &o[2], &o[3], &len) != 4 ||
+      o[0] > 255 || o[1] > 255 || o[2] > 255 || o[3] > 255)
+    return NULL;
+  *addr = (o[0] << 24) | (o[1] << 16) | (o[2] << 8) | o[3];
+  return str + len;
+}
+
+
+/*
+ * Returns the first dot from p on which separates two octets, or the
+ * end of the string. The decimal point of a weight ("1@70.5") and the
+ * dots in parentheses ("zipf(100,1.2)") are not.
+ */
+static const char *octet_dot(const char *p)
+{
+  int weight_f = FALSE, point_f = FALSE, depth = 0;
+
+  for (; *p; p++) {
+    switch (*p) {
+    case '(':
+      depth++;
+      break;
+    case ')':
+      depth--;
+      break;
+    case '@':
+      weight_f = TRUE;
+      point_f = FALSE;
+      break;
+    case ',':
+      weight_f = FALSE;
+      break;
+    case '.':
+      if (depth > 0)
+	break;
+      if (!weight_f || point_f)
+	return p;
+      point_f = TRUE;
+      break;
+    }
+  }
+  return p;
+}
+
+void compile_ipaddr_expr(const char *str, ipaddr_expr_t *ie)
+{
+  char buf[256];	/* XXX */
+  const char *p = str;
+  int i, dots = 0;
+
+  /*
+   * A whole address space can be given as:
+
+     10.0.0.0/8      (sequential over the prefix)
+     :10.0.0.0/8     (random over the prefix)
+     10.0.0.1-10.0.255.254[/step]  (sequential)
+     10.0.0.1:10.0.255.254         (random)
+
+   * Such an expression costs the same per address no matter how large
+   * the space is. So does
+
+     zipf(10.0.0.0/16,1.2)  (Zipf over the prefix, 10.0.0.0 first)
+   */
+  memset(ie, 0, sizeof(*ie));
+
+  if (!strncmp(str, "zipf(", 5)) {
+    u_int32_t mask;
+    double s;
+    int len;
+
+    if ((p = parse_ipaddr(str + 5, &ie->start)) == NULL ||
+	sscanf(p, "/%d,%lf)", &len, &s) != 2 || !strchr(p, ')') ||
+	len < 32 - 24 || len > 32)
+      fatal("invalid zipf address expression (prefix /8 to /32)");
+    mask = len ? 0xffffffffU << (32 - len) : 0;
+    ie->mode = ADDR_TYPE_ZIPF;
+    ie->start &= mask;
+    ie->end = ie->start | ~mask;
+    ie->cur = ie->start;
+    compile_zipf(&ie->exp[0], (long)ie->end - ie->start + 1, s, ie->start);
+    return;
+  }
+  for (p = octet_dot(str); *p; p = octet_dot(p + 1))
+    dots++;
+
+  if (dots == 3 && strchr(str, '/') &&
+      !strchr(str, '-') && !strchr(str + 1, ':') && !strchr(str, '@')) {
+    u_int32_t mask;
+    int len;
+
+    p = str;
+    if (*p == ':') {
+      ie->mode = ADDR_TYPE_RND;
+      p++;
+    } else
+      ie->mode = ADDR_TYPE_SEQ;
+    if ((p = parse_ipaddr(p, &ie->start)) == NULL ||
+	sscanf(p, "/%d", &len) != 1 || len < 0 || len > 32)
+      fatal("invalid prefix");
+    mask = len ? 0xffffffffU << (32 - len) : 0;
+    ie->start &= mask;
+    ie->end = ie->start | ~mask;
+    ie->step = 1;
+    ie->cur = ie->start;
+    return;
+  }
+
+  if (dots == 6) {
+    ie->step = 1;
+    if ((p = parse_ipaddr(str, &ie->start)) == NULL ||
+	(*p != '-' && *p != ':'))
+      fatal("invalid address range");
+    ie->mode = (*p == '-') ? ADDR_TYPE_SEQ : ADDR_TYPE_RND;
+    if ((p = parse_ipaddr(p + 1, &ie->end)) == NULL ||
+	(*p && sscanf(p, "/%u", &ie->step) != 1) ||
+	ie->step < 1 || ie->start > ie->end)
+      fatal("invalid address range");
+    ie->cur = ie->start;
+    return;
+  }
+
+  /* str = "<val_expr>.<val_expr>.<val_expr>.<val_expr>" */
+
+  ie->mode = ADDR_TYPE_OCTET;
+  if (dots != 3)
+    fatal("invalid address expression");
+  for (i=0; i<4; i++) {
+    p = octet_dot(str);
+    if (p - str >= sizeof(buf) - 1)
+      fatal("out of range");
+    memset(buf, 0, sizeof(buf));
+    strncpy(buf, str, p - str);
+    /* right in place, so that a failure leaves nothing unowned */
+    compile_expr(buf, &ie->exp[i]);
+    str = p + 1;
+  }
+}
+
+void free_expr(val_expr_t *e)
+{
+  free(e->vals);
+  free(e->prob);
+  free(e->alias);
+}
+
+void free_addr_expr(ipaddr_expr_t *ie)
+{
+  int i;
+
+  for (i=0; i<4; i++)
+    free_expr(&ie->exp[i]);
+}
+
+
+/* a uniform random number in (0, 1] */
+static inline double rng_unit(void)
+{
+  return ((rng_next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* values are put in fields of 32 bits at most */
+static inline long clamp_val(double x)
+{
+  return x < 4294967295.0 ? (long)x : 0xffffffffL;
+}
+
+long expr_val(val_expr_t *e)
+{
+  long val = e->cur;
+
+  switch (e->mode) {
+  case EXPR_TYPE_SEQ:
+    e->cur += e->step;
+    if (e->cur > e->end)
+      e->cur = e->start;
+    return val;
+  case EXPR_TYPE_RND:
+    e->cur = e->start + (long)rng_range(e->end - e->start + 1);
+    return e->cur;
+  case EXPR_TYPE_PRB: {
+    u_int64_t r = rng_next();
+    u_int32_t i = ((r >> 32) * e->nvals) >> 32;
+
+    e->cur = (r & 0xffffffff) < e->prob[i] ?
+      e->vals[i] : e->vals[e->alias[i]];
+    return e->cur;
+  }
+  case EXPR_TYPE_ZIPF: {
+    u_int64_t r = rng_next();
+    u_int32_t i = ((r >> 32) * e->nvals) >> 32;
+
+    e->cur = e->start + ((r & 0xffffffff) < e->prob[i] ? i : e->alias[i]);
+    return e->cur;
+  }
+  case EXPR_TYPE_PARETO:
+    /* by inversion: xm / U^(1/alpha) */
+    e->cur = clamp_val(e->p1 * pow(rng_unit(), e->p2));
+    return e->cur;
+  case EXPR_TYPE_LOGNORM: {
+    /* Box-Muller */
+    double z = sqrt(-2.0 * log(rng_unit())) * cos(2 * M_PI * rng_unit());
+
+    e->cur = clamp_val(exp(e->p1 + e->p2 * z));
+    return e->cur;
+  }
+  default:
+    fatal("unknown expr mode");
+  }
+  return 0L;	/* should not reach here */
+}
+
+
+/*
+ * Returns the next address of the expression in host byte order.
+ */
+u_int32_t expr_addr(ipaddr_expr_t *ie)
+{
+  u_int32_t addr = 0;
+  long octet;
+  int i;
+
+  switch (ie->mode) {
+  case ADDR_TYPE_SEQ:
+    addr = ie->cur;
+    if ((u_int64_t)ie->cur + ie->step > ie->end)
+      ie->cur = ie->start;
+    else
+      ie->cur += ie->step;
+    return addr;
+  case ADDR_TYPE_RND:
+    ie->cur = ie->start + rng_range((u_int64_t)ie->end - ie->start + 1);
+    return ie->cur;
+  case ADDR_TYPE_OCTET:
+    for (i=0; i<4; i++) {
+      octet = expr_val(&(ie->exp[i]));
+      if (octet < 0 || octet > 255) {
+	fatal("ipaddr_expr error");
+      }
+      addr = (addr << 8) | octet;
+    }
+    return addr;
+  case ADDR_TYPE_ZIPF:
+    ie->cur = expr_val(&ie->exp[0]);
+    return ie->cur;
+  default:
+    fatal("unknown ipaddr_expr mode");
+  }
+  return 0;	/* should not reach here */
+}
+
+/*
+ * Returns TRUE if the expression always evaluates to the same value.
+ */
+int expr_static(val_expr_t *e)
+{
+  return (e->mode == EXPR_TYPE_SEQ && (e->step == 0 || e->start == e->end)) ||
+    (e->mode == EXPR_TYPE_RND && e->start == e->end) ||
+    ((e->mode == EXPR_TYPE_PRB || e->mode == EXPR_TYPE_ZIPF) &&
+     e->nvals == 1);
+}
+
+int expr_addr_static(ipaddr_expr_t *ie)
+{
+  int i;
+
+  if (ie->mode != ADDR_TYPE_OCTET)
+    return ie->start == ie->end;
+  for (i=0; i<4; i++)
+    if (!expr_static(&ie->exp[i]))
+      return FALSE;
+  return TRUE;
+}
+
+/*
+ * Column kernels
+ *
+ * Expressions are evaluated a column at a time: all the values of one
+ * field for all the records of a PDU. The kernels below fill such a
+ * column and byte-swap it into the record layout. They come in scalar,
+ * SSE4.1 and AVX2 flavors, picked at startup by simd_init(). Random
+ * columns are drawn from an 8-lane xoshiro128** generator which is laid
+ * out the same for every flavor, so a seed gives the same flows on any
+ * CPU.
+ */
+
+#define VRNG_LANES	8
+
+__thread u_int32_t vrng[4][VRNG_LANES] __attribute__((aligned(32)));
+
+struct simd_ops {
+  const char *name;
+  void (*seq)(u_int32_t *col, int n, u_int32_t cur, u_int32_t step);
+  void (*rnd)(u_int32_t *col, int n, u_int32_t start, u_int32_t range);
+  void (*put16)(u_int8_t *base, int stride, const u_int32_t *col, int n);
+  void (*put32)(u_int8_t *base, int stride, const u_int32_t *col, int n);
+};
+
+struct simd_ops simd;
+
+/*
+ * Seeds the calling thread's column generator from its scalar one.
+ */
+void vrng_init(void)
+{
+  int k, j;
+
+  for (j=0; j < VRNG_LANES; j++) {
+    for (k=0; k<4; k++)
+      vrng[k][j] = rng_next() >> 32;
+    vrng[0][j] |= 1;	/* the state must not be all zero */
+  }
+}
+
+static inline u_int32_t rotl32(u_int32_t x, int k)
+{
+  return (x << k) | (x >> (32 - k));
+}
+
+/*
+ * Maps a 32-bit random number into [start, start + range), where a range
+ * of 0 stands for 2^32.
+ */
+static inline u_int32_t map_range(u_int32_t r, u_int32_t start, u_int32_t range)
+{
+  return start + (range ? (u_int32_t)(((u_int64_t)r * range) >> 32) : r);
+}
+
+static void seq_scalar(u_int32_t *col, int n, u_int32_t cur, u_int32_t step)
+{
+  int i;
+
+  for (i=0; i<n; i++, cur += step)
+    col[i] = cur;
+}
+
+static void rnd_scalar(u_int32_t *col, int n, u_int32_t start, u_int32_t range)
+{
+  u_int32_t t;
+  int i, j;
+
+  for (i=0; i<n; i += VRNG_LANES)
+    for (j=0; j < VRNG_LANES; j++) {
+      u_int32_t r = rotl32(vrng[1][j] * 5, 7) * 9;
+
+      t = vrng[1][j] << 9;
+      vrng[2][j] ^= vrng[0][j];
+      vrng[3][j] ^= vrng[1][j];
+      vrng[1][j] ^= vrng[2][j];
+      vrng[0][j] ^= vrng[3][j];
+      vrng[2][j] ^= t;
+      vrng[3][j] = rotl32(vrng[3][j], 11);
+      if (i + j < n)
+	col[i + j] = map_range(r, start, range);
+    }
+}
+
+static void put16_scalar(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  u_int16_t v;
+  int i;
+
+  for (i=0; i<n; i++, base += stride) {
+    v = htons(col[i]);
+    memcpy(base, &v, 2);
+  }
+}
+
+static void put32_scalar(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  u_int32_t v;
+  int i;
+
+  for (i=0; i<n; i++, base += stride) {
+    v = htonl(col[i]);
+    memcpy(base, &v, 4);
+  }
+}
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#include <immintrin.h>
+
+#define X86_SIMD
+
+__attribute__((target("sse4.1")))
+static void seq_sse4(u_int32_t *col, int n, u_int32_t cur, u_int32_t step)
+{
+  __m128i v = _mm_setr_epi32(cur, cur + step, cur + 2 * step, cur + 3 * step);
+  __m128i inc = _mm_set1_epi32(4 * step);
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    _mm_storeu_si128((__m128i *)(col + i), v);
+    v = _mm_add_epi32(v, inc);
+  }
+  seq_scalar(col + i, n - i, cur + i * step, step);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i rotl_sse4(__m128i x, int k)
+{
+  return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+}
+
+__attribute__((target("sse4.1")))
+static void rnd_sse4(u_int32_t *col, int n, u_int32_t start, u_int32_t range)
+{
+  __m128i s[2][4], r, t, lo, hi;
+  __m128i five = _mm_set1_epi32(5), nine = _mm_set1_epi32(9);
+  __m128i vstart = _mm_set1_epi32(start), vrange = _mm_set1_epi32(range);
+  u_int32_t tmp[4] __attribute__((aligned(16)));
+  int i, h, k;
+
+  for (h=0; h<2; h++)
+    for (k=0; k<4; k++)
+      s[h][k] = _mm_load_si128((__m128i *)&vrng[k][h * 4]);
+
+  for (i=0; i<n; ) {
+    for (h=0; h<2; h++, i += 4) {
+      r = _mm_mullo_epi32(rotl_sse4(_mm_mullo_epi32(s[h][1], five), 7), nine);
+      t = _mm_slli_epi32(s[h][1], 9);
+      s[h][2] = _mm_xor_si128(s[h][2], s[h][0]);
+      s[h][3] = _mm_xor_si128(s[h][3], s[h][1]);
+      s[h][1] = _mm_xor_si128(s[h][1], s[h][2]);
+      s[h][0] = _mm_xor_si128(s[h][0], s[h][3]);
+      s[h][2] = _mm_xor_si128(s[h][2], t);
+      s[h][3] = rotl_sse4(s[h][3], 11);
+
+      if (range) {
+	lo = _mm_mul_epu32(r, vrange);
+	hi = _mm_mul_epu32(_mm_srli_epi64(r, 32), vrange);
+	r = _mm_blend_epi16(_mm_srli_epi64(lo, 32), hi, 0xcc);
+      }
+      r = _mm_add_epi32(r, vstart);
+
+      if (i + 4 <= n)
+	_mm_storeu_si128((__m128i *)(col + i), r);
+      else if (i < n) {
+	_mm_store_si128((__m128i *)tmp, r);
+	memcpy(col + i, tmp, (n - i) * 4);
+      }
+    }
+  }
+
+  for (h=0; h<2; h++)
+    for (k=0; k<4; k++)
+      _mm_store_si128((__m128i *)&vrng[k][h * 4], s[h][k]);
+}
+
+__attribute__((target("sse4.1")))
+static void put16_sse4(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  const __m128i swap = _mm_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12,
+				     -1, -1, -1, -1, -1, -1, -1, -1);
+  u_int16_t tmp[8] __attribute__((aligned(16)));
+  int i, j;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    _mm_store_si128((__m128i *)tmp,
+		    _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(col + i)),
+				     swap));
+    for (j=0; j<4; j++, base += stride)
+      memcpy(base, &tmp[j], 2);
+  }
+  put16_scalar(base, stride, col + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void put32_sse4(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+				     11, 10, 9, 8, 15, 14, 13, 12);
+  u_int32_t tmp[4] __attribute__((aligned(16)));
+  int i, j;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    _mm_store_si128((__m128i *)tmp,
+		    _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(col + i)),
+				     swap));
+    for (j=0; j<4; j++, base += stride)
+      memcpy(base, &tmp[j], 4);
+  }
+  put32_scalar(base, stride, col + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void seq_avx2(u_int32_t *col, int n, u_int32_t cur, u_int32_t step)
+{
+  __m256i v = _mm256_add_epi32(_mm256_set1_epi32(cur),
+			       _mm256_mullo_epi32(_mm256_set1_epi32(step),
+						  _mm256_setr_epi32(0, 1, 2, 3,
+								    4, 5, 6, 7)));
+  __m256i inc = _mm256_set1_epi32(8 * step);
+  int i;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i *)(col + i), v);
+    v = _mm256_add_epi32(v, inc);
+  }
+  seq_scalar(col + i, n - i, cur + i * step, step);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotl_avx2(__m256i x, int k)
+{
+  return _mm256_or_si256(_mm256_slli_epi32(x, k), _mm256_srli_epi32(x, 32 - k));
+}
+
+__attribute__((target("avx2")))
+static void rnd_avx2(u_int32_t *col, int n, u_int32_t start, u_int32_t range)
+{
+  __m256i s0 = _mm256_load_si256((__m256i *)vrng[0]);
+  __m256i s1 = _mm256_load_si256((__m256i *)vrng[1]);
+  __m256i s2 = _mm256_load_si256((__m256i *)vrng[2]);
+  __m256i s3 = _mm256_load_si256((__m256i *)vrng[3]);
+  __m256i five = _mm256_set1_epi32(5), nine = _mm256_set1_epi32(9);
+  __m256i vstart = _mm256_set1_epi32(start), vrange = _mm256_set1_epi32(range);
+  __m256i r, t, lo, hi;
+  u_int32_t tmp[8] __attribute__((aligned(32)));
+  int i;
+
+  for (i=0; i<n; i += 8) {
+    r = _mm256_mullo_epi32(rotl_avx2(_mm256_mullo_epi32(s1, five), 7), nine);
+    t = _mm256_slli_epi32(s1, 9);
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = rotl_avx2(s3, 11);
+
+    if (range) {
+      lo = _mm256_mul_epu32(r, vrange);
+      hi = _mm256_mul_epu32(_mm256_srli_epi64(r, 32), vrange);
+      r = _mm256_blend_epi32(_mm256_srli_epi64(lo, 32), hi, 0xaa);
+    }
+    r = _mm256_add_epi32(r, vstart);
+
+    if (i + 8 <= n)
+      _mm256_storeu_si256((__m256i *)(col + i), r);
+    else {
+      _mm256_store_si256((__m256i *)tmp, r);
+      memcpy(col + i, tmp, (n - i) * 4);
+    }
+  }
+
+  _mm256_store_si256((__m256i *)vrng[0], s0);
+  _mm256_store_si256((__m256i *)vrng[1], s1);
+  _mm256_store_si256((__m256i *)vrng[2], s2);
+  _mm256_store_si256((__m256i *)vrng[3], s3);
+}
+
+__attribute__((target("avx2")))
+static void put16_avx2(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  const __m256i swap = _mm256_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12,
+					-1, -1, -1, -1, -1, -1, -1, -1,
+					1, 0, 5, 4, 9, 8, 13, 12,
+					-1, -1, -1, -1, -1, -1, -1, -1);
+  u_int16_t tmp[16] __attribute__((aligned(32)));
+  int i, j;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    _mm256_store_si256((__m256i *)tmp,
+		       _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(col + i)),
+					   swap));
+    for (j=0; j<4; j++, base += stride)
+      memcpy(base, &tmp[j], 2);
+    for (j=8; j<12; j++, base += stride)
+      memcpy(base, &tmp[j], 2);
+  }
+  put16_scalar(base, stride, col + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void put32_avx2(u_int8_t *base, int stride, const u_int32_t *col, int n)
+{
+  const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					11, 10, 9, 8, 15, 14, 13, 12,
+					3, 2, 1, 0, 7, 6, 5, 4,
+					11, 10, 9, 8, 15, 14, 13, 12);
+  u_int32_t tmp[8] __attribute__((aligned(32)));
+  int i, j;
+
+  for (i=0; i + 8 <= n; i += 8) {
+    _mm256_store_si256((__m256i *)tmp,
+		       _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(col + i)),
+					   swap));
+    for (j=0; j<8; j++, base += stride)
+      memcpy(base, &tmp[j], 4);
+  }
+  put32_scalar(base, stride, col + i, n - i);
+}
+#endif /* X86_SIMD */
+
+/*
+ * Picks the best kernels the CPU supports.
+ */
+void simd_init(int nosimd_f)
+{
+  simd.name = "scalar";
+  simd.seq = seq_scalar;
+  simd.rnd = rnd_scalar;
+  simd.put16 = put16_scalar;
+  simd.put32 = put32_scalar;
+
+#ifdef X86_SIMD
+  if (nosimd_f)
+    return;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    simd.name = "avx2";
+    simd.seq = seq_avx2;
+    simd.rnd = rnd_avx2;
+    simd.put16 = put16_avx2;
+    simd.put32 = put32_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    simd.name = "sse4.1";
+    simd.seq = seq_sse4;
+    simd.rnd = rnd_sse4;
+    simd.put16 = put16_sse4;
+    simd.put32 = put32_sse4;
+  }
+#endif
+}
+
+/*
+ * Stores a column into the field at base of n consecutive records.
+ */
+void put_col(u_int8_t *base, int stride, int width, const u_int32_t *col, int n)
+{
+  int i;
+
+  switch (width) {
+  case 1:
+    for (i=0; i<n; i++, base += stride)
+      *base = col[i];
+    break;
+  case 2:
+    simd.put16(base, stride, col, n);
+    break;
+  case 4:
+    simd.put32(base, stride, col, n);
+    break;
+  }
+}
+
+
+/*
+ * Evaluates the expression n times into col. Same as calling expr_val()
+ * n times, but sequential and random expressions run in a kernel.
+ */
+void expr_fill(val_expr_t *e, u_int32_t *col, int n)
+{
+  long run;
+  int i;
+
+  switch (e->mode) {
+  case EXPR_TYPE_SEQ:
+    while (n > 0) {
+      run = e->step ? (e->end - e->cur) / e->step + 1 : n;
+      if (run > n)
+	run = n;
+      if (run < 1)
+	run = 1;
+      simd.seq(col, run, e->cur, e->step);
+      col += run;
+      n -= run;
+      e->cur += run * e->step;
+      if (e->cur > e->end)
+	e->cur = e->start;
+    }
+    return;
+  case EXPR_TYPE_RND:
+    if (e->start >= 0 && e->end <= 0xffffffffL && n > 0) {
+      simd.rnd(col, n, e->start, (u_int32_t)(e->end - e->start + 1));
+      e->cur = col[n - 1];
+      return;
+    }
+    break;
+  }
+
+  for (i=0; i<n; i++)
+    col[i] = expr_val(e);
+}
+
+void expr_addr_fill(ipaddr_expr_t *ie, u_int32_t *col, int n)
+{
+  u_int32_t octet[COL_MAX];
+  u_int64_t run;
+  int i, k;
+
+  switch (ie->mode) {
+  case ADDR_TYPE_SEQ:
+    while (n > 0) {
+      run = ((u_int64_t)ie->end - ie->cur) / ie->step + 1;
+      if (run > n)
+	run = n;
+      simd.seq(col, run, ie->cur, ie->step);
+      col += run;
+      n -= run;
+      if ((u_int64_t)ie->cur + run * ie->step > ie->end)
+	ie->cur = ie->start;
+      else
+	ie->cur += run * ie->step;
+    }
+    return;
+  case ADDR_TYPE_RND:
+    if (n > 0) {
+      simd.rnd(col, n, ie->start, ie->end - ie->start + 1);
+      ie->cur = col[n - 1];
+    }
+    return;
+  case ADDR_TYPE_OCTET:
+    for (i=0; i<n; i++)
+      col[i] = 0;
+    for (k=0; k<4; k++) {
+      expr_fill(&ie->exp[k], octet, n);
+      for (i=0; i<n; i++) {
+	if (octet[i] > 255)
+	  fatal("ipaddr_expr error");
+	col[i] = (col[i] << 8) | octet[i];
+      }
+    }
+    return;
+  case ADDR_TYPE_ZIPF:
+    expr_fill(&ie->exp[0], col, n);
+    return;
+  default:
+    fatal("unknown ipaddr_expr mode");
+  }
+}
+
+/*
+ * Time stamps. The clock is read once per batch of PDUs (see gen_flows()
+ * and replay_pool()), and the uptime and the wall clock time put in the
+ * PDUs are derived from that reading with the offsets taken at startup,
+ * by integer math. CLOCK_MONOTONIC_COARSE is even cheaper to read, at
+ * the resolution of the kernel tick.
+ *
+ * With --time-warp, the reading is of a virtual clock which runs that
+ * many times as fast from startup on, and --start-time sets the wall
+ * clock time it starts at, so all the time stamps follow it.
+ */
+clockid_t clock_id = CLOCK_MONOTONIC;
+u_int64_t up_base;	/* uptime - clock, in nanosecond */
+u_int64_t real_base;	/* wall clock - clock, in nanosecond */
+double warp = 0;	/* speed of the virtual clock, 0 = real time */
+u_int64_t warp_t0;	/* clock at which the virtual one started */
+
+static inline u_int64_t clock_ns(void)
+{
+  struct timespec ts;
+  u_int64_t t;
+
+  clock_gettime(clock_id, &ts);
+  t = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (warp > 0)
+    t = warp_t0 + (u_int64_t)((t - warp_t0) * warp);
+  return t;
+}
+
+/*
+ * Returns sysuptime (in millisecond) at a clock reading
+ */
+static inline u_int32_t clock_uptime(u_int64_t t)
+{
+  return (t + up_base) / 1000000;
+}
+
+#if defined (__FreeBSD__) || defined (__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+/*
+ * Sets up the clock, and the virtual one if speed is positive. A start
+ * time of 0 (nanoseconds since the epoch) is now.
+ */
+void clock_init(int coarse_f, u_int64_t start, double speed)
+{
+  struct timespec ts;
+  u_int64_t t, real, up;
+
+#if defined (CLOCK_MONOTONIC_COARSE)
+  if (coarse_f)
+    clock_id = CLOCK_MONOTONIC_COARSE;
+#endif
+
+  t = clock_ns();
+  clock_gettime(CLOCK_REALTIME, &ts);
+  real = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+#if defined (__linux__)
+  /* what /proc/uptime tells, suspended time included */
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  up = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#elif defined (__FreeBSD__) || defined (__APPLE__)
+  {
+    struct timeval boottime;
+    int mib[2];
+    size_t size;
+
+    mib[0] = CTL_KERN;
+    mib[1] = KERN_BOOTTIME;
+    size = sizeof(boottime);
+    if (sysctl(mib, 2, &boottime, &size, NULL, 0) == -1)
+      fatal("cannot get the boot time");
+    up = real - ((u_int64_t)boottime.tv_sec * 1000000000ULL +
+		 boottime.tv_usec * 1000ULL);
+  }
+#else
+  up = t;
+#endif
+
+  up_base = up - t;
+  real_base = (start ? start : real) - t;
+  warp_t0 = t;
+  warp = speed;
+}
+
+/*
+ * Parses a start time, either seconds since the epoch or
+ * "YYYY-MM-DD[THH:MM[:SS]]" in UTC, into nanoseconds since the epoch.
+ */
+u_int64_t parse_time(const char *str)
+{
+  struct tm tm;
+  char *p;
+  time_t t;
+  int n;
+
+  t = strtoll(str, &p, 10);
+  if (*p != '\0') {
+    memset(&tm, 0, sizeof(tm));
+    n = sscanf(str, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+	       &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    if (n != 3 && n != 5 && n != 6)
+      fatal("invalid start time");
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    t = timegm(&tm);
+  }
+  if (t <= 0)
+    fatal("invalid start time");
+  return (u_int64_t)t * 1000000000ULL;
+}
+
+/*
+ * Returns CLOCK_MONOTONIC in nanosecond
+ */
+u_int64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Parses "<num>[k|m|g][fps|pps|bps]", e.g. "250k" (flows/s), "10kpps"
+ * or "1gbps", into a rate and its unit.
+ */
+double parse_rate_val(const char *str, int *unit)
+{
+  double rate;
+  char *p;
+
+  rate = strtod(str, &p);
+  switch (*p) {
+  case 'k': case 'K': rate *= 1e3; p++; break;
+  case 'm': case 'M': rate *= 1e6; p++; break;
+  case 'g': case 'G': rate *= 1e9; p++; break;
+  }
+
+  if (*p == '\0' || !strcmp(p, "fps"))
+    *unit = RATE_FLOWS;
+  else if (!strcmp(p, "pps"))
+    *unit = RATE_PDUS;
+  else if (!strcmp(p, "bps"))
+    *unit = RATE_BITS;
+  else
+    fatal("invalid rate");
+
+  if (p == str || rate < 0)
+    fatal("invalid rate");
+  return rate;
+}
+
+void parse_rate(const char *str, struct pacer *pc)
+{
+  pc->rate = parse_rate_val(str, &pc->unit);
+  if (pc->rate <= 0)
+    fatal("invalid rate");
+}
+
+/*
+ * Returns the units a profile releases from its start to t sec.
+ */
+double prof_units(struct rate_prof *rp, double t)
+{
+  double sum = 0, loop = 0, end = rp->t[rp->npts - 1];
+  int i;
+
+  for (i=1; i < rp->npts; i++)
+    loop += (rp->r[i - 1] + rp->r[i]) / 2 * (rp->t[i] - rp->t[i - 1]);
+  if (rp->loop_f) {
+    sum = floor(t / end) * loop;
+    t = fmod(t, end);
+  } else if (t > end)
+    t = end;
+
+  for (i=1; i < rp->npts && rp->t[i] <= t; i++)
+    sum += (rp->r[i - 1] + rp->r[i]) / 2 * (rp->t[i] - rp->t[i - 1]);
+  if (i < rp->npts && t > rp->t[i - 1]) {
+    double r = rp->r[i - 1] + (rp->r[i] - rp->r[i - 1]) *
+      (t - rp->t[i - 1]) / (rp->t[i] - rp->t[i - 1]);
+
+    sum += (rp->r[i - 1] + r) / 2 * (t - rp->t[i - 1]);
+  }
+  return sum;
+}
+
+/* number of segments a sine profile is made of */
+#define SINE_SEGS	256
+
+static void add_point(struct rate_prof *rp, double t, double rate)
+{
+  if ((rp->npts & (rp->npts - 1)) == 0) {
+    rp->t = realloc(rp->t, sizeof(double) * (rp->npts ? 2 * rp->npts : 1));
+    rp->r = realloc(rp->r, sizeof(double) * (rp->npts ? 2 * rp->npts : 1));
+    if (!rp->t || !rp->r)
+      fatal("out of memory");
+  }
+  rp->t[rp->npts] = t;
+  rp->r[rp->npts] = rate;
+  rp->npts++;
+}
+
+static double prof_rate(struct rate_prof *rp, const char *str, int *unit)
+{
+  double rate;
+  int u;
+
+  rate = parse_rate_val(str, &u);
+  if (rp->npts && u != *unit)
+    fatal("the rates of a profile must be of the same unit");
+  *unit = u;
+  return rate;
+}
+
+/*
+ * Parses a rate profile, one of
+
+   0=10k,60=100k,60=1m,70=1m,70=100k[,loop]  (sec=rate, linear between)
+   sine(86400,10k,100k)  (from min to max and back over the period, looping)
+   <file>                (a "sec rate" or "loop" line each, # for comments)
+
+ * with the rates as of -r, all in the same unit.
+ */
+void parse_rate_prof(const char *spec, struct rate_prof *rp, int *unit)
+{
+  char buf[256], lo[64], hi[64], line[256], rate[64], *tok, *save;
+  double period, t, min, max;
+  FILE *fp;
+  int i;
+
+  memset(rp, 0, sizeof(*rp));
+  if (!strncmp(spec, "sine(", 5)) {
+    if (sscanf(spec, "sine(%lf,%63[^,],%63[^)])", &period, lo, hi) != 3 ||
+	period <= 0)
+      fatal("invalid sine rate profile");
+    min = prof_rate(rp, lo, unit);
+    rp->npts = 1;	/* so that both must be of the same unit */
+    max = prof_rate(rp, hi, unit);
+    rp->npts = 0;
+    /* from min up to max and back, in straight pieces */
+    for (i=0; i <= SINE_SEGS; i++)
+      add_point(rp, period * i / SINE_SEGS, min + (max - min) *
+		(1 - cos(2 * M_PI * i / SINE_SEGS)) / 2);
+    rp->loop_f = TRUE;
+  } else if (strchr(spec, '=')) {
+    if (strlen(spec) >= sizeof(buf))
+      fatal("rate profile too long; put it in a file");
+    strcpy(buf, spec);
+    for (tok = strtok_r(buf, ",", &save); tok;
+	 tok = strtok_r(NULL, ",", &save)) {
+      if (!strcmp(tok, "loop"))
+	rp->loop_f = TRUE;
+      else if (sscanf(tok, "%lf=%63s", &t, rate) == 2)
+	add_point(rp, t, prof_rate(rp, rate, unit));
+      else
+	fatal("invalid rate profile point");
+    }
+  } else {
+    if ((fp = fopen(spec, "r")) == NULL) {
+      perror(spec);
+      exit(1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+      if ((tok = strchr(line, '#')) != NULL)
+	*tok = '\0';
+      if (sscanf(line, " %63s", rate) != 1)
+	continue;
+      if (!strcmp(rate, "loop"))
+	rp->loop_f = TRUE;
+      else if (sscanf(line, "%lf %63s", &t, rate) == 2)
+	add_point(rp, t, prof_rate(rp, rate, unit));
+      else
+	fatal("invalid rate profile line");
+    }
+    fclose(fp);
+  }
+
+  if (rp->npts == 0 || rp->t[0] != 0)
+    fatal("a rate profile must start at 0 sec");
+  for (i=1; i < rp->npts; i++)
+    if (rp->t[i] < rp->t[i - 1])
+      fatal("the times of a rate profile must not go back");
+  if (rp->loop_f && !(rp->t[rp->npts - 1] > 0))
+    fatal("a looping rate profile must last longer than 0 sec");
+  if (!(prof_units(rp, rp->t[rp->npts - 1]) > 0))
+    fatal("a rate profile must send something");
+}
+
+/*
+ * Moves the pacer on along its profile by the time it takes to release
+ * cost units, by solving the area under each linear segment exactly.
+ * The worker's rate is its share of the profile.
+ */
+static void prof_advance(struct pacer *pc, double cost)
+{
+  struct rate_prof *rp = pc->prof;
+  double s, r, r1, area, d;
+
+  cost *= pc->shares;
+  while (cost > 0) {
+    if (pc->seg >= rp->npts - 1) {
+      if (!rp->loop_f) {
+	pc->end_f = TRUE;
+	return;
+      }
+      pc->base += rp->t[rp->npts - 1];
+      pc->pos = 0;
+      pc->seg = 0;
+      continue;
+    }
+    if (rp->t[pc->seg + 1] <= rp->t[pc->seg]) {
+      pc->seg++;	/* a step */
+      continue;
+    }
+    s = (rp->r[pc->seg + 1] - rp->r[pc->seg]) /
+      (rp->t[pc->seg + 1] - rp->t[pc->seg]);
+    r = rp->r[pc->seg] + s * (pc->pos - rp->t[pc->seg]);
+    r1 = rp->r[pc->seg + 1];
+    area = (r + r1) / 2 * (rp->t[pc->seg + 1] - pc->pos);
+    if (cost >= area) {
+      cost -= area;
+      pc->pos = rp->t[++pc->seg];
+      continue;
+    }
+    /* r * dt + s * dt^2 / 2 = cost */
+    d = r * r + 2 * s * cost;
+    pc->pos += 2 * cost / (r + sqrt(d > 0 ? d : 0));
+    cost = 0;
+  }
+}
+
+/*
+ * Blocks until a batch worth `cost' units may be released. Deadlines
+ * are absolute (t0 + units / rate, or the point of the rate profile by
+ * which units have been released), so an oversleep is paid back by the
+ * following batches instead of lowering the long-term rate. With
+ * spin_ns, the last part of the wait is spent busy-polling the clock,
+ * which gets sub-microsecond gaps right where nanosleep cannot.
+ */
+void pace(struct pacer *pc, double cost)
+{
+  struct timespec ts;
+  u_int64_t deadline, now, wake;
+  double dev;
+
+  if (pc->prof)
+    deadline = pc->t0 + (u_int64_t)((pc->base + pc->pos) * 1e9);
+  else
+    deadline = pc->t0 + (u_int64_t)(pc->units * 1e9 / pc->rate);
+  now = now_ns();
+
+  while (now + pc->spin_ns < deadline && !stop_f) {
+    /* wake up every 100ms to see if we were interrupted */
+    wake = deadline - pc->spin_ns;
+    if (wake > now + 100000000ULL)
+      wake = now + 100000000ULL;
+    ts.tv_sec = wake / 1000000000ULL;
+    ts.tv_nsec = wake % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    now = now_ns();
+  }
+  while (now < deadline && !stop_f)
+    now = now_ns();
+
+  if (pc->last) {
+    dev = (double)(now - pc->last) - (double)(deadline - pc->last_deadline);
+    pc->dev_sum += dev;
+    pc->dev_sq += dev * dev;
+    if (dev < 0)
+      dev = -dev;
+    if (dev > pc->dev_max)
+      pc->dev_max = dev;
+    pc->gaps++;
+  }
+  pc->last = now;
+  pc->last_deadline = deadline;
+  pc->last_cost = cost;
+  pc->units += cost;
+  if (pc->prof) {
+    prof_advance(pc, cost);
+    if (pc->end_f)
+      stop_f = TRUE;	/* the profile is over */
+  }
+}
+
+/*
+ * Returns the Internet checksum of len octets at p.
+ */
+u_int16_t in_cksum(const void *p, int len)
+{
+  const u_int16_t *w = p;
+  u_int32_t sum = 0;
+
+  for (; len > 1; len -= 2)
+    sum += *w++;
+  if (len)
+    sum += *(const u_int8_t *)w;
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum += sum >> 16;
+  return ~sum;
+}
+
+/*
+ * Prepares the Ethernet, IPv4 and UDP headers of the frames that carry
+ * PDUs from src to dst. Addresses and ports are in network byte order.
+ */
+void init_frame(struct frame_hdr *fh, u_int32_t src, u_int16_t sport,
+		u_int32_t dst, u_int16_t dport)
+{
+  static const u_int8_t mac_src[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+  static const u_int8_t mac_dst[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+
+  memset(fh, 0, sizeof(*fh));
+  memcpy(fh->eth_dst, mac_dst, 6);
+  memcpy(fh->eth_src, mac_src, 6);
+  fh->eth_type = htons(ETHERTYPE_IPV4);
+  fh->ip_vhl = 0x45;
+  fh->ip_ttl = 64;
+  fh->ip_p = IPPROTO_UDP;
+  fh->ip_src = src;
+  fh->ip_dst = dst;
+  fh->uh_sport = sport;
+  fh->uh_dport = dport;
+}
+
+/*
+ * Sets the length fields of the frame headers for a PDU of len octets,
+ * and advances the IP ID. The UDP checksum is left 0 (none).
+ */
+static inline void frame_set_len(struct frame_hdr *fh, size_t len)
+{
+  fh->ip_len = htons(len + IP_UDP_HDRLEN);
+  fh->ip_id = htons(ntohs(fh->ip_id) + 1);
+  fh->ip_sum = 0;
+  fh->ip_sum = in_cksum(&fh->ip_vhl, 20);
+  fh->uh_ulen = htons(len + 8);
+}
+
+/*
+ * Prepares the frame headers for the i-th queued PDU.
+ */
+static inline void set_frame(struct flow_exporter *ex, int i)
+{
+  if (ex->spoof_f)
+    ex->frame.ip_src = ex->src[i];
+  frame_set_len(&ex->frame, ex->iov[i].iov_len);
+}
+
+/*
+ * Sets up ex->frame for the frames the worker builds by itself, with
+ * the source address and port the kernel would use for the collector.
+ */
+void frame_open(struct flow_exporter *ex)
+{
+  struct sockaddr_in src;
+  socklen_t len = sizeof(src);
+
+  if (connect(ex->sock, (struct sockaddr *)&ex->to, sizeof(ex->to)) == -1 ||
+      getsockname(ex->sock, (struct sockaddr *)&src, &len) == -1) {
+    perror("connect");
+    exit(1);
+  }
+  init_frame(&ex->frame, src.sin_addr.s_addr, src.sin_port,
+	     ex->to.sin_addr.s_addr, ex->to.sin_port);
+}
+
+/*
+ * Counts n PDUs from slot i as sent.
+ */
+static inline void count_sent(struct flow_exporter *ex, int i, int n)
+{
+  ex->pdu_sent += n;
+  for (n += i; i < n; i++)
+    ex->octets_sent += ex->iov[i].iov_len;
+}
+
+/*
+ * Counts a failed send by its errno. Only the first failure of a kind
+ * is reported here, as there may be a lot of them when the socket
+ * buffer overflows; the rest show up in the stats.
+ */
+void send_error(struct flow_exporter *ex, const char *what)
+{
+  long *cnt;
+
+  switch (errno) {
+  case ENOBUFS:
+    cnt = &ex->err_nobufs;
+    break;
+  case EAGAIN:
+    cnt = &ex->err_again;
+    break;
+  default:
+    cnt = &ex->err_other;
+    break;
+  }
+  if ((*cnt)++ == 0 || debug)
+    perror(what);
+}
+
+/*
+ * Writes all of len octets, or dies.
+ */
+void write_all(int fd, const u_int8_t *p, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) == -1) {
+      if (errno == EINTR)
+	continue;
+      perror("write");
+      exit(1);
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+/*
+ * Appends to the pcap buffer. The buffer is written out only when it
+ * is full, so the file grows in large aligned chunks no matter how
+ * small the packets are.
+ */
+static inline void pcap_put(struct flow_exporter *ex, const void *p, size_t len)
+{
+  size_t room;
+
+  while (len > 0) {
+    room = PCAP_BUFSIZE - ex->pcap_used;
+    if (room > len)
+      room = len;
+    memcpy(ex->pcap_buf + ex->pcap_used, p, room);
+    ex->pcap_used += room;
+    p = (const u_int8_t *)p + room;
+    len -= room;
+    if (ex->pcap_used == PCAP_BUFSIZE) {
+      write_all(ex->pcap_fd, ex->pcap_buf, PCAP_BUFSIZE);
+      ex->pcap_used = 0;
+    }
+  }
+}
+
+void pcap_open(struct flow_exporter *ex, const char *file)
+{
+  struct pcap_file_hdr fh;
+  char path[1024];
+
+  if (nworkers > 1) {
+    snprintf(path, sizeof(path), "%s.%d", file, ex->id);
+    file = path;
+  }
+  if ((ex->pcap_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror(file);
+    exit(1);
+  }
+  if (posix_memalign((void **)&ex->pcap_buf, 4096, PCAP_BUFSIZE) != 0)
+    fatal("out of memory");
+  ex->pcap_used = 0;
+  frame_open(ex);
+
+  memset(&fh, 0, sizeof(fh));
+  fh.magic = PCAP_MAGIC_NSEC;
+  fh.version_major = 2;
+  fh.version_minor = 4;
+  fh.snaplen = 65535;
+  fh.linktype = PCAP_LINKTYPE_ETHERNET;
+  pcap_put(ex, &fh, sizeof(fh));
+}
+
+/*
+ * Maps a capture of NetFlow V5 exports to replay, as it is: the PDUs are
+ * read right from the mapping, so a large file takes no time to open and
+ * only the pages being replayed take memory.
+ */
+void pcap_in_open(struct pcap_in *pin, const char *file)
+{
+  struct pcap_file_hdr fh;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    perror(file);
+    exit(1);
+  }
+  if (st.st_size < sizeof(fh))
+    fatal("pcap-in is not a pcap file");
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  close(fd);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  pin->map = map;
+  pin->size = st.st_size;
+  if ((pin->pos = calloc(nworkers, sizeof(u_int64_t))) == NULL)
+    fatal("out of memory");
+
+  memcpy(&fh, pin->map, sizeof(fh));
+  switch (fh.magic) {
+  case PCAP_MAGIC_USEC:
+  case PCAP_MAGIC_NSEC:
+    pin->swap_f = FALSE;
+    break;
+  case __builtin_bswap32(PCAP_MAGIC_USEC):
+  case __builtin_bswap32(PCAP_MAGIC_NSEC):
+    pin->swap_f = TRUE;
+    fh.magic = __builtin_bswap32(fh.magic);
+    fh.linktype = __builtin_bswap32(fh.linktype);
+    break;
+  default:
+    fatal("pcap-in is not a pcap file (pcapng is not supported)");
+  }
+  pin->nsec_f = (fh.magic == PCAP_MAGIC_NSEC);
+  pin->linktype = fh.linktype;
+  if (pin->linktype != PCAP_LINKTYPE_NULL &&
+      pin->linktype != PCAP_LINKTYPE_ETHERNET &&
+      pin->linktype != PCAP_LINKTYPE_RAW &&
+      pin->linktype != PCAP_LINKTYPE_SLL && pin->linktype != PCAP_LINKTYPE_SLL2)
+    fatal("pcap-in must be of Ethernet, raw IP, loopback or Linux cooked "
+	  "packets");
+}
+
+/*
+ * Returns the UDP payload of a captured packet and its length in *len,
+ * or NULL if it is not a whole UDP datagram.
+ */
+static const u_int8_t *pcap_in_udp(struct pcap_in *pin, const u_int8_t *p,
+				   u_int32_t caplen, int *len)
+{
+  const u_int8_t *end = p + caplen;
+  u_int16_t type = 0;
+  int hl;
+
+  switch (pin->linktype) {
+  case PCAP_LINKTYPE_NULL:
+    p += 4;
+    break;
+  case PCAP_LINKTYPE_ETHERNET:
+    for (p += 12; p + 2 <= end; p += 4) {
+      type = (p[0] << 8) | p[1];
+      if (type != 0x8100 && type != 0x88a8)	/* VLAN tags */
+	break;
+    }
+    p += 2;
+    break;
+  case PCAP_LINKTYPE_SLL:
+    p += 16;
+    break;
+  case PCAP_LINKTYPE_SLL2:
+    p += 20;
+    break;
+  }
+
+  if (p + 1 > end)
+    return NULL;
+  switch (p[0] >> 4) {
+  case 4:
+    hl = (p[0] & 0xf) * 4;
+    /* no fragments */
+    if (hl < 20 || p + hl > end || p[9] != IPPROTO_UDP ||
+	(((p[6] << 8) | p[7]) & 0x3fff))
+      return NULL;
+    break;
+  case 6:
+    hl = 40;	/* no extension headers */
+    if (p + 40 > end || p[6] != IPPROTO_UDP)
+      return NULL;
+    break;
+  default:
+    return NULL;
+  }
+  p += hl;
+  if (p + 8 > end)
+    return NULL;
+  *len = ((p[4] << 8) | p[5]) - 8;
+  p += 8;
+  if (*len < 0 || p + *len > end)
+    return NULL;
+  return p;
+}
+
+/*
+ * Writes the queued PDUs out as packets of a pcap file, each captured
+ * at the wall clock time of its header (virtual with --time-warp).
+ */
+void pcap_write_batch(struct flow_exporter *ex)
+{
+  struct pcap_pkt_hdr ph;
+  u_int64_t real;
+  int i;
+
+  for (i=0; i < ex->batch_cnt; i++) {
+    real = ex->stamp[i] + real_base;
+    ph.ts_sec = real / 1000000000ULL;
+    ph.ts_frac = real % 1000000000ULL;
+    ph.caplen = ph.len = sizeof(struct frame_hdr) + ex->iov[i].iov_len;
+    set_frame(ex, i);
+    pcap_put(ex, &ph, sizeof(ph));
+    pcap_put(ex, &ex->frame, sizeof(ex->frame));
+    pcap_put(ex, ex->iov[i].iov_base, ex->iov[i].iov_len);
+  }
+  count_sent(ex, 0, ex->batch_cnt);
+}
+
+void pcap_close(struct flow_exporter *ex)
+{
+  write_all(ex->pcap_fd, ex->pcap_buf, ex->pcap_used);
+  close(ex->pcap_fd);
+  free(ex->pcap_buf);
+  ex->pcap_fd = -1;
+}
+
+#if defined (__linux__)
+/*
+ * Looks the MAC address of addr (network byte order) up in the ARP
+ * table of ifname. Returns 0 if found.
+ */
+int arp_lookup(const char *ifname, u_int32_t addr, u_int8_t *mac)
+{
+  char line[256], ip[64], hw[64], dev[64];
+  unsigned int m[6];
+  struct in_addr in;
+  FILE *fp;
+  int i, found = -1;
+
+  if ((fp = fopen("/proc/net/arp", "r")) == NULL)
+    return -1;
+  while (found && fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%63s %*s %*s %63s %*s %63s", ip, hw, dev) != 3 ||
+	strcmp(dev, ifname) != 0 || inet_aton(ip, &in) == 0 ||
+	in.s_addr != addr ||
+	sscanf(hw, "%x:%x:%x:%x:%x:%x",
+	       &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+      continue;
+    for (i=0; i<6; i++)
+      mac[i] = m[i];
+    found = 0;
+  }
+  fclose(fp);
+  return found;
+}
+
+/*
+ * Returns the default gateway on ifname (network byte order), or 0.
+ */
+u_int32_t default_gw(const char *ifname)
+{
+  char line[256], dev[64];
+  unsigned int dst, gw, flags;
+  u_int32_t addr = 0;
+  FILE *fp;
+
+  if ((fp = fopen("/proc/net/route", "r")) == NULL)
+    return 0;
+  while (!addr && fgets(line, sizeof(line), fp))
+    if (sscanf(line, "%63s %x %x %x", dev, &dst, &gw, &flags) == 4 &&
+	strcmp(dev, ifname) == 0 && dst == 0 && gw != 0)
+      addr = gw;	/* already in network byte order */
+  fclose(fp);
+  return addr;
+}
+
+/*
+ * Opens an AF_PACKET socket on ifname with a TX ring of TX_RING_FRAMES
+ * frames, each big enough for a PDU in its Ethernet frame. dst_mac is
+ * the next hop's; if NULL, it is looked up in the ARP table, for the
+ * collector first and then for the default gateway.
+ */
+void ring_open(struct flow_exporter *ex, const char *ifname,
+	       const char *dst_mac, int qdisc_bypass_f)
+{
+  struct tpacket_req req;
+  struct sockaddr_ll ll;
+  struct ifreq ifr;
+  unsigned int m[6];
+  size_t need, block;
+  int ver = TPACKET_V2, one = 1, i;
+
+  frame_open(ex);
+
+  if ((ex->ring_fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1) {
+    perror("socket(AF_PACKET)");
+    exit(1);
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+  if (ioctl(ex->ring_fd, SIOCGIFHWADDR, &ifr) == -1) {
+    perror(ifname);
+    exit(1);
+  }
+  memcpy(ex->frame.eth_src, ifr.ifr_hwaddr.sa_data, 6);
+
+  if (dst_mac) {
+    if (sscanf(dst_mac, "%x:%x:%x:%x:%x:%x",
+	       &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+      fatal("dst-mac must be like 00:11:22:33:44:55");
+    for (i=0; i<6; i++)
+      ex->frame.eth_dst[i] = m[i];
+  } else if (ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK)
+    memset(ex->frame.eth_dst, 0, 6);
+  else if (arp_lookup(ifname, ex->to.sin_addr.s_addr, ex->frame.eth_dst) &&
+	   arp_lookup(ifname, default_gw(ifname), ex->frame.eth_dst))
+    fatal("cannot find the MAC address of the next hop; use dst-mac");
+
+  if (setsockopt(ex->ring_fd, SOL_PACKET, PACKET_VERSION,
+		 &ver, sizeof(ver)) == -1) {
+    perror("PACKET_VERSION");
+    exit(1);
+  }
+#ifdef PACKET_QDISC_BYPASS
+  if (qdisc_bypass_f && setsockopt(ex->ring_fd, SOL_PACKET,
+				   PACKET_QDISC_BYPASS, &one, sizeof(one)) == -1)
+    perror("PACKET_QDISC_BYPASS");
+#endif
+
+  /* frames of a power of 2, packed in blocks of at least a page */
+  need = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll) +
+    sizeof(struct frame_hdr) + ex->slot_size;
+  for (ex->ring_frame_size = 2048; ex->ring_frame_size < need; )
+    ex->ring_frame_size <<= 1;
+  block = ex->ring_frame_size < 4096 ? 4096 : ex->ring_frame_size;
+
+  memset(&req, 0, sizeof(req));
+  req.tp_frame_size = ex->ring_frame_size;
+  req.tp_frame_nr = TX_RING_FRAMES;
+  req.tp_block_size = block;
+  req.tp_block_nr = TX_RING_FRAMES * ex->ring_frame_size / block;
+  if (setsockopt(ex->ring_fd, SOL_PACKET, PACKET_TX_RING,
+		 &req, sizeof(req)) == -1) {
+    perror("PACKET_TX_RING");
+    exit(1);
+  }
+  ex->ring = mmap(NULL, req.tp_block_nr * block, PROT_READ | PROT_WRITE,
+		  MAP_SHARED, ex->ring_fd, 0);
+  if (ex->ring == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  ex->ring_cur = 0;
+
+  /* protocol 0: nothing is received on this socket */
+  memset(&ll, 0, sizeof(ll));
+  ll.sll_family = AF_PACKET;
+  ll.sll_ifindex = if_nametoindex(ifname);
+  if (bind(ex->ring_fd, (struct sockaddr *)&ll, sizeof(ll)) == -1) {
+    perror("bind");
+    exit(1);
+  }
+}
+
+/*
+ * Returns the next frame of the TX ring, waiting for the kernel to
+ * free one if the ring is full.
+ */
+static struct tpacket2_hdr *ring_frame(struct flow_exporter *ex)
+{
+  struct tpacket2_hdr *h;
+  struct pollfd pfd;
+
+  h = (struct tpacket2_hdr *)(ex->ring + ex->ring_cur * ex->ring_frame_size);
+  for (;;) {
+    switch (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE)) {
+    case TP_STATUS_AVAILABLE:
+      return h;
+    case TP_STATUS_WRONG_FORMAT:
+      ex->ring_errs++;
+      return h;
+    }
+    send(ex->ring_fd, NULL, 0, MSG_DONTWAIT);
+    pfd.fd = ex->ring_fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 100) == -1 && errno != EINTR) {
+      perror("poll");
+      exit(1);
+    }
+  }
+}
+
+/*
+ * Puts the queued PDUs into the TX ring in their Ethernet frames, and
+ * has the kernel send them all with a single call, bypassing the UDP
+ * and IP layers.
+ */
+void ring_send_batch(struct flow_exporter *ex)
+{
+  struct tpacket2_hdr *h;
+  u_int8_t *data;
+  int i;
+
+  for (i=0; i < ex->batch_cnt; i++) {
+    h = ring_frame(ex);
+    data = (u_int8_t *)h + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+    set_frame(ex, i);
+    memcpy(data, &ex->frame, sizeof(ex->frame));
+    memcpy(data + sizeof(ex->frame), ex->iov[i].iov_base, ex->iov[i].iov_len);
+    h->tp_len = sizeof(ex->frame) + ex->iov[i].iov_len;
+    __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    if (++ex->ring_cur == TX_RING_FRAMES)
+      ex->ring_cur = 0;
+  }
+  if (send(ex->ring_fd, NULL, 0, MSG_DONTWAIT) == -1)
+    send_error(ex, "send");
+  count_sent(ex, 0, ex->batch_cnt);
+}
+
+/*
+ * Waits for the frames left in the TX ring to go out.
+ */
+void ring_close(struct flow_exporter *ex)
+{
+  while (send(ex->ring_fd, NULL, 0, 0) == -1 && errno == EINTR)
+    ;
+  if (ex->ring_errs)
+    fprintf(stderr, "worker %d: %ld frames refused by the kernel\n",
+	    ex->id, ex->ring_errs);
+  close(ex->ring_fd);
+  ex->ring_fd = -1;
+}
+
+/*
+ * io_uring, by raw system calls.
+ */
+static int uring_enter(int fd, unsigned int submit, unsigned int wait)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait,
+		 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Reaps the completions there are, waiting for at least wait of them.
+ * A zero-copy send completes twice: once sent, and once its buffer is
+ * released (IORING_CQE_F_NOTIF); the slot is free after the latter.
+ */
+void uring_reap(struct flow_exporter *ex, unsigned int wait)
+{
+  struct uring *ur = ex->ur;
+  struct io_uring_cqe *cqe;
+  unsigned int head, tail;
+
+  if (wait && uring_enter(ur->fd, 0, wait) == -1 && errno != EINTR) {
+    perror("io_uring_enter");
+    exit(1);
+  }
+
+  head = *ur->cq_head;
+  tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    cqe = &ur->cqes[head & *ur->cq_mask];
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+      ur->pending[cqe->user_data]--;
+      continue;
+    }
+    if (cqe->res >= 0) {
+      ex->pdu_sent++;
+      ex->octets_sent += cqe->res;
+    } else {
+      ur->errs++;
+      ur->last_err = errno = -cqe->res;
+      send_error(ex, "send");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      ur->pending[cqe->user_data]--;
+  }
+  __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submits a send for each queued PDU, without waiting for any of them
+ * to complete, and moves on to the next group of slots once all of
+ * its sends are done. Large PDUs go with zero copy.
+ */
+void uring_send_batch(struct flow_exporter *ex)
+{
+  struct uring *ur = ex->ur;
+  struct io_uring_sqe *sqe;
+  unsigned int tail = *ur->sq_tail;
+  int i, g = ur->group;
+
+  for (i=0; i < ex->batch_cnt; i++, tail++) {
+    sqe = &ur->sqes[tail & *ur->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    if (ur->zc_f && ex->iov[i].iov_len >= URING_ZC_MIN) {
+      sqe->opcode = IORING_OP_SEND_ZC;
+      if (ur->fixed_f)
+	sqe->ioprio = IORING_RECVSEND_FIXED_BUF;	/* buf_index 0 */
+    }
+    sqe->fd = ex->sock;
+    sqe->addr = (unsigned long)ex->iov[i].iov_base;
+    sqe->len = ex->iov[i].iov_len;
+    if (ur->zc_f) {		/* else the socket is connected */
+      sqe->addr2 = (unsigned long)&ex->to;	/* sendto(), as it were */
+      sqe->addr_len = sizeof(ex->to);
+    }
+    sqe->user_data = g;
+    ur->sq_array[tail & *ur->sq_mask] = tail & *ur->sq_mask;
+  }
+  __atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+  ur->pending[g] += ex->batch_cnt;
+
+  while (uring_enter(ur->fd, ex->batch_cnt, 0) == -1) {
+    if (errno == EINTR)
+      continue;
+    perror("io_uring_enter");
+    exit(1);
+  }
+  uring_reap(ex, 0);
+
+  /* the next group must be done with before it is filled again */
+  g = ur->group = (g + 1) % URING_GROUPS;
+  while (ur->pending[g] > 0)
+    uring_reap(ex, 1);
+  for (i=0; i < ex->batch_size; i++)
+    ex->iov[i].iov_base = ur->slots +
+      ((size_t)g * ex->batch_size + i) * ex->slot_size;
+}
+
+/*
+ * Waits for all the sends in flight.
+ */
+void uring_close(struct flow_exporter *ex)
+{
+  struct uring *ur = ex->ur;
+  int g;
+
+  for (g=0; g < URING_GROUPS; g++)
+    while (ur->pending[g] > 0)
+      uring_reap(ex, 1);
+  if (ur->errs)
+    fprintf(stderr, "worker %d: %ld sends failed (%s)\n",
+	    ex->id, ur->errs, strerror(ur->last_err));
+  close(ur->fd);
+}
+#endif /* __linux__ */
+
+#ifdef UDP_SEGMENT
+/*
+ * Sends the queued PDUs as UDP GSO super-packets. A super-packet is
+ * made of a run of PDUs of the same length, optionally followed by a
+ * shorter one, so the kernel can cut them apart again at gso_size.
+ * Returns -1 if GSO is not usable.
+ */
+int send_gso(struct flow_exporter *ex)
+{
+  char ctl[CMSG_SPACE(sizeof(u_int16_t))];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  u_int16_t gso_size;
+  int segs, i, n;
+
+  for (i=0; i < ex->batch_cnt; i += n) {
+    gso_size = ex->iov[i].iov_len;
+    segs = GSO_MAX_BYTES / gso_size;
+    if (segs > GSO_MAX_SEGS)
+      segs = GSO_MAX_SEGS;
+    for (n=1; i + n < ex->batch_cnt && n < segs; n++) {
+      if (ex->iov[i + n].iov_len > gso_size)
+	break;
+      if (ex->iov[i + n].iov_len < gso_size) {
+	n++;
+	break;
+      }
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &ex->to;
+    msg.msg_namelen = sizeof(ex->to);
+    msg.msg_iov = &ex->iov[i];
+    msg.msg_iovlen = n;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+    memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+
+    while (sendmsg(ex->sock, &msg, 0) == -1) {
+      if (errno == EINTR)
+	continue;
+      if (i == 0 && (errno == EINVAL || errno == EIO ||
+		     errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+	return -1;	/* nothing sent yet; let sendmmsg() take over */
+      send_error(ex, "sendmsg");
+      msg.msg_iovlen = 0;
+      break;
+    }
+    count_sent(ex, i, msg.msg_iovlen);
+  }
+  return 0;
+}
+#endif
+
+/*
+ * Writes the queued PDUs to the TCP stream with as few writev() calls
+ * as the socket buffer allows.
+ */
+void send_tcp(struct flow_exporter *ex)
+{
+  struct iovec *iov = ex->iov;
+  int cnt = ex->batch_cnt;
+  ssize_t n;
+
+  while (cnt > 0) {
+    if ((n = writev(ex->sock, iov, cnt)) == -1) {
+      if (errno == EINTR)
+	continue;
+      send_error(ex, "writev");
+      stop_f = TRUE;	/* the session is gone */
+      return;
+    }
+    for (; cnt > 0 && (size_t)n >= iov->iov_len; iov++, cnt--) {
+      n -= iov->iov_len;
+      count_sent(ex, iov - ex->iov, 1);
+    }
+    if (n > 0) {
+      /* finish the PDU cut in the middle, leaving the slot as it is */
+      write_all(ex->sock, (u_int8_t *)iov->iov_base + n, iov->iov_len - n);
+      count_sent(ex, iov - ex->iov, 1);
+      iov++;
+      cnt--;
+    }
+  }
+}
+
+/*
+ * Hands all the queued PDUs to the kernel, preferably in one go.
+ */
+void send_batch(struct flow_exporter *ex)
+{
+  int sent = 0, n;
+
+  if (ex->batch_cnt == 0)
+    return;
+
+  if (ex->pc.rate > 0) {
+    double cost = 0;
+
+    switch (ex->pc.unit) {
+    case RATE_FLOWS:
+      cost = ex->batch_flows;
+      break;
+    case RATE_PDUS:
+      cost = ex->batch_cnt;
+      break;
+    case RATE_BITS:
+      for (n=0; n < ex->batch_cnt; n++)
+	cost += (ex->iov[n].iov_len + IP_UDP_HDRLEN) * 8;
+      break;
+    }
+    pace(&ex->pc, cost);
+  }
+  ex->batch_flows = 0;
+
+  if (ex->pcap_fd >= 0) {
+    pcap_write_batch(ex);
+    ex->batch_cnt = 0;
+    return;
+  }
+
+  if (nosend_f) {
+    count_sent(ex, 0, ex->batch_cnt);
+    ex->batch_cnt = 0;
+    return;
+  }
+
+  if (tcp_f) {
+    send_tcp(ex);
+    ex->batch_cnt = 0;
+    return;
+  }
+
+#if defined (__linux__)
+  if (ex->ring_fd >= 0) {
+    ring_send_batch(ex);
+    ex->batch_cnt = 0;
+    return;
+  }
+  if (ex->ur) {
+    uring_send_batch(ex);
+    ex->batch_cnt = 0;
+    return;
+  }
+#endif
+
+#ifdef UDP_SEGMENT
+  if (ex->gso_f && ex->batch_cnt > 1) {
+    if (send_gso(ex) == 0) {
+      ex->batch_cnt = 0;
+      return;
+    }
+    if (debug)
+      fprintf(stderr, "UDP GSO not available, using sendmmsg()\n");
+    ex->gso_f = FALSE;
+  }
+#endif
+
+  while (sent < ex->batch_cnt) {
+    n = sendmmsg(ex->sock, &ex->msgs[sent], ex->batch_cnt - sent, 0);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      send_error(ex, "sendmmsg");
+      sent++;		/* drop the PDU that failed and go on */
+      continue;
+    }
+    count_sent(ex, sent, n);
+    sent += n;
+  }
+  ex->batch_cnt = 0;
+}
+
+/*
+ * Stamps the time of a clock reading on a PDU header, with up_off msec
+ * added to the uptime. sysup_time and unix_secs are at the same place
+ * in V5 and V9 headers.
+ */
+static inline void patch_time(u_int8_t *buf, u_int64_t t, u_int32_t up_off)
+{
+  struct nf_v5_hdr *hdr = (struct nf_v5_hdr *)buf;
+  u_int64_t real = t + real_base;
+
+  if (nf_version == NF_VERSION_IPFIX) {
+    ((struct ipfix_hdr *)buf)->export_time = htonl(real / 1000000000ULL);
+    return;
+  }
+  hdr->sysup_time = htonl(clock_uptime(t) + up_off);
+  hdr->unix_secs = htonl(real / 1000000000ULL);
+  if (nf_version == NF_VERSION_V5)
+    hdr->unix_nsecs = htonl(real % 1000000000ULL);
+}
+
+/*
+ * Sets engine_type and engine_id of a V5 PDU, or the source_id (IPFIX
+ * observation domain) made of them, as Cisco does, of V9 and IPFIX.
+ * Virtual exporters have them fixed.
+ */
+static inline void set_source(struct flow_exporter *ex, u_int8_t *buf)
+{
+  struct nf_v5_hdr *hdr = (struct nf_v5_hdr *)buf;
+  u_int32_t type, id, sid;
+
+  if (ex->nvex) {
+    type = ex->vx->engine_type;
+    id = ex->vx->engine_id;
+    sid = ex->vx->source_id;
+  } else {
+    type = expr_val(&ex->engine_type) & 0xff;
+    id = expr_val(&ex->engine_id) & 0xff;
+    sid = (type << 8) | id;
+  }
+
+  switch (nf_version) {
+  case NF_VERSION_V5:
+    hdr->engine_type = type;
+    hdr->engine_id = id;
+    break;
+  case NF_VERSION_V9:
+    ((struct nf_v9_hdr *)buf)->source_id = htonl(sid);
+    break;
+  case NF_VERSION_IPFIX:
+    ((struct ipfix_hdr *)buf)->domain_id = htonl(sid);
+    break;
+  }
+}
+
+/*
+ * Sets the header fields of a PDU which change from PDU to PDU, and
+ * returns the length of the PDU.
+ */
+int fill_hdr(struct flow_exporter *ex, u_int8_t *buf, int count)
+{
+  struct nf_v5_hdr *hdr = (struct nf_v5_hdr *)buf;
+  struct nf_v9_hdr *hdr9 = (struct nf_v9_hdr *)buf;
+  struct nf_v9_set_hdr *set;
+  struct vexporter *vx = ex->vx;
+  int len, pad;
+
+  vx->flows += count;
+  if (!ex->hdr_static)
+    set_source(ex, buf);
+
+  if (nf_version == NF_VERSION_V5) {
+    hdr->count = htons(count);
+    patch_time(buf, ex->clk, vx->up_off);
+    hdr->flow_sequence = htonl(vx->flows - count);
+    return ex->rec_off + ex->lay.reclen * count;
+  }
+
+  /* the data FlowSet is padded to a 4-octet boundary */
+  len = sizeof(*set) + ex->lay.reclen * count;
+  pad = -len & 3;
+  set = (struct nf_v9_set_hdr *)(buf + ex->rec_off - sizeof(*set));
+  set->id = htons(NF9_TEMPLATE_ID);
+  set->length = htons(len + pad);
+  memset((u_int8_t *)set + len, 0, pad);
+
+  len += (u_int8_t *)set - buf + pad;
+
+  if (nf_version == NF_VERSION_IPFIX) {
+    struct ipfix_hdr *ih = (struct ipfix_hdr *)buf;
+
+    ih->length = htons(len);
+    patch_time(buf, ex->clk, 0);
+    ih->sequence = htonl(vx->flows - count);
+  } else {
+    hdr9->count = htons(count + ex->tmpl_f);
+    patch_time(buf, ex->clk, vx->up_off);
+    hdr9->package_sequence = htonl(vx->pdus++);
+  }
+  vx->tmpl_pdus++;
+
+  return len;
+}
+
+/*
+ * Starts a PDU in the slot being filled: decides where its records go
+ * and puts in the template if it is due.
+ */
+static inline void begin_pdu(struct flow_exporter *ex)
+{
+  u_int8_t *buf = ex->iov[ex->batch_cnt].iov_base;
+  struct vexporter *vx = ex->vx;
+  u_int64_t now;
+
+  ex->rec_off = ex->lay.hdrlen;
+  ex->tmpl_f = FALSE;
+  if (nf_version == NF_VERSION_V5)
+    return;
+
+  if (tcp_f) {
+    /* a TCP session keeps the template until it is closed */
+    ex->tmpl_f = !vx->tmpl_last;
+    vx->tmpl_last = 1;
+  } else if (tmpl_refresh_ns) {
+    now = ex->clk;
+    ex->tmpl_f = !vx->tmpl_last || now - vx->tmpl_last >= tmpl_refresh_ns;
+    if (ex->tmpl_f)
+      vx->tmpl_last = now;
+  } else {
+    ex->tmpl_f = !vx->tmpl_last || vx->tmpl_pdus >= tmpl_refresh_pdus;
+    vx->tmpl_last = 1;
+  }
+  if (ex->tmpl_f) {
+    memcpy(buf + ex->rec_off, tset, tset_len);
+    ex->rec_off += tset_len;
+    vx->tmpl_pdus = 0;
+  }
+  ex->rec_off += sizeof(struct nf_v9_set_hdr);
+}
+
+/*
+ * Picks the source address of the PDU being queued, if spoofed: the
+ * virtual exporter's own, or the next one of the expression.
+ */
+static inline void spoof_src(struct flow_exporter *ex)
+{
+  if (ex->spoof_f)
+    ex->src[ex->batch_cnt] = ex->nvex ? ex->vx->src_addr :
+      htonl(expr_addr(&ex->spoof));
+}
+
+/*
+ * Fills in the header of the PDU being built and queues it, and sends
+ * the whole batch when no slot is left.
+ */
+void flush_flow(struct flow_exporter *ex)
+{
+  if (ex->flow_cnt == 0)
+    return;
+
+  ex->iov[ex->batch_cnt].iov_len =
+    fill_hdr(ex, ex->iov[ex->batch_cnt].iov_base, ex->flow_cnt);
+  ex->stamp[ex->batch_cnt] = ex->clk;
+
+  spoof_src(ex);
+  ex->batch_flows += ex->flow_cnt;
+  ex->flow_cnt = 0;
+  if (++ex->batch_cnt == ex->batch_size)
+    send_batch(ex);
+}
+
+/* writes val as a field of width octets at p, in network byte order */
+static inline void put_field(u_int8_t *p, int width, u_int32_t val)
+{
+  u_int16_t v16;
+
+  switch (width) {
+  case 1:
+    *p = val;
+    break;
+  case 2:
+    v16 = htons(val);
+    memcpy(p, &v16, 2);
+    break;
+  case 4:
+    val = htonl(val);
+    memcpy(p, &val, 4);
+    break;
+  }
+}
+
+/* reads a field of width octets at p, in network byte order */
+static inline u_int32_t get_field(const u_int8_t *p, int width)
+{
+  u_int16_t v16;
+  u_int32_t v32;
+
+  switch (width) {
+  case 1:
+    return *p;
+  case 2:
+    memcpy(&v16, p, 2);
+    return ntohs(v16);
+  default:
+    memcpy(&v32, p, 4);
+    return ntohl(v32);
+  }
+}
+
+/*
+ * Compiles a profile for the worker's record layout: the fields which
+ * never change are put in its template, the others are listed in gen.
+ */
+void compile_prof(struct flow_exporter *ex, struct flow_prof *p)
+{
+  struct rec_layout *lay = &ex->lay;
+  int f;
+
+  memset(p->tmpl, 0, sizeof(p->tmpl));
+  p->ngen = 0;
+  for (f=0; f < NUM_FIELDS; f++) {
+    void *e = (u_int8_t *)&p->fx + fields[f].expr;
+    struct rec_field *rf = &p->gen[p->ngen];
+
+    if (lay->off[f] < 0 || f == FIELD_FIRST || f == FIELD_LAST)
+      continue;
+
+    if (fields[f].addr && expr_addr_static(e))
+      put_field(p->tmpl + lay->off[f], lay->width[f], expr_addr(e));
+    else if (!fields[f].addr && expr_static(e))
+      put_field(p->tmpl + lay->off[f], lay->width[f], expr_val(e));
+    else {
+      rf->addr = fields[f].addr ? e : NULL;
+      rf->val = fields[f].addr ? NULL : e;
+      rf->off = lay->off[f];
+      rf->width = lay->width[f];
+      p->ngen++;
+    }
+  }
+}
+
+/*
+ * Frees a scenario nobody uses anymore, with the expressions it does
+ * not share with the command line.
+ */
+void free_scenario(struct scenario *scn)
+{
+  struct flow_prof *p;
+  int f;
+
+  for (p = scn->prof; p < scn->prof + scn->nprof; p++)
+    for (f=0; f < NUM_FIELDS; f++) {
+      void *e = (u_int8_t *)&p->fx + fields[f].expr;
+
+      if (!(p->own & 1 << f))
+	continue;
+      if (fields[f].addr)
+	free_addr_expr(e);
+      else
+	free_expr(e);
+    }
+  free_expr(&scn->pick);
+  free(scn->prof);
+  free(scn);
+}
+
+/*
+ * Switches the worker to the scenario the main thread has handed over.
+ * This happens between two records, so nothing but the profiles, not
+ * the sequence numbers or the pacing, changes.
+ */
+void use_scenario(struct flow_exporter *ex)
+{
+  struct scenario *scn, *old = ex->scn;
+  int i;
+
+  scn = __atomic_exchange_n(&ex->next_scn, NULL, __ATOMIC_ACQUIRE);
+  if (scn == NULL)
+    return;
+
+  free(ex->mix);
+  if ((ex->mix = malloc(sizeof(struct flow_prof) * scn->nprof)) == NULL)
+    fatal("out of memory");
+  memcpy(ex->mix, scn->prof, sizeof(struct flow_prof) * scn->nprof);
+  for (i=0; i < scn->nprof; i++)
+    compile_prof(ex, &ex->mix[i]);
+  memcpy(&ex->pick, &scn->pick, sizeof(ex->pick));
+  ex->nmix = scn->nprof;
+  ex->scn = scn;
+
+  if (old && __atomic_sub_fetch(&old->users, 1, __ATOMIC_ACQ_REL) == 0)
+    free_scenario(old);
+}
+
+/*
+ * Renders n records of a profile at rec, with all the fields but the
+ * first and last switched times; the values of their expressions are
+ * put in first and last, unless NULL.
+ */
+static void render_prof(struct flow_exporter *ex, struct flow_prof *p,
+			u_int8_t *rec, int n, u_int32_t *first,
+			u_int32_t *last)
+{
+  struct rec_layout *lay = &ex->lay;
+  struct rec_field *f;
+  u_int32_t col[COL_MAX];
+  int i;
+
+  for (i=0; i<n; i++)
+    memcpy(rec + i * lay->reclen, p->tmpl, lay->reclen);
+
+  for (f = p->gen; f < p->gen + p->ngen; f++) {
+    if (f->addr)
+      expr_addr_fill(f->addr, col, n);
+    else
+      expr_fill(f->val, col, n);
+    put_col(rec + f->off, lay->reclen, f->width, col, n);
+  }
+
+  if (last)
+    expr_fill(&p->fx.last, last, n);
+  if (first)
+    expr_fill(&p->fx.first, first, n);
+}
+
+/*
+ * Renders n (up to COL_MAX) records at rec, as render_prof(). With a
+ * scenario, the profile of each record is drawn by the weights, and
+ * those of the same profile are rendered together.
+ */
+static void render_records(struct flow_exporter *ex, u_int8_t *rec, int n,
+			   u_int32_t *first, u_int32_t *last)
+{
+  int cnt[MAX_PROFILES], i;
+
+  if (__atomic_load_n(&ex->next_scn, __ATOMIC_RELAXED))
+    use_scenario(ex);
+  if (ex->nmix == 0) {
+    render_prof(ex, &ex->base, rec, n, first, last);
+    return;
+  }
+
+  memset(cnt, 0, sizeof(cnt));
+  for (i=0; i<n; i++)
+    cnt[expr_val(&ex->pick)]++;
+  for (i=0; i < ex->nmix; i++) {
+    if (cnt[i] == 0)
+      continue;
+    render_prof(ex, &ex->mix[i], rec, cnt[i], first, last);
+    rec += cnt[i] * ex->lay.reclen;
+    if (first)
+      first += cnt[i];
+    if (last)
+      last += cnt[i];
+  }
+}
+
+/*
+ * Generates n flow records right into the PDU being filled, in network
+ * byte order. Only the fields which can change are evaluated, a column
+ * at a time; all the others come from the record template.
+ */
+void gen_flows(struct flow_exporter *ex, int n)
+{
+  struct rec_layout *lay = &ex->lay;
+  u_int32_t col[COL_MAX], last[COL_MAX], ut;
+  u_int8_t *rec;
+  int i;
+
+  /* jumbo PDUs may hold more records than a column */
+  for (; n > COL_MAX; n -= COL_MAX)
+    gen_flows(ex, COL_MAX);
+
+  /*
+   * The clock is read at the start of a batch, or for every flow when
+   * there are waits in between.
+   */
+  if ((ex->flow_cnt == 0 && ex->batch_cnt == 0) || ex->wait_f)
+    ex->clk = clock_ns();
+  if (ex->flow_cnt == 0)
+    begin_pdu(ex);
+  rec = (u_int8_t *)ex->iov[ex->batch_cnt].iov_base +
+    ex->rec_off + ex->flow_cnt * lay->reclen;
+  render_records(ex, rec, n, col, last);
+
+  /* first and last are relative to the uptime, so they always change */
+  ut = clock_uptime(ex->clk) + ex->vx->up_off;
+  for (i=0; i<n; i++)
+    last[i] = ut - last[i];
+  for (i=0; i<n; i++)
+    col[i] = last[i] - col[i];
+  if (lay->off[FIELD_LAST] >= 0)
+    put_col(rec + lay->off[FIELD_LAST], lay->reclen, lay->width[FIELD_LAST],
+	    last, n);
+  if (lay->off[FIELD_FIRST] >= 0)
+    put_col(rec + lay->off[FIELD_FIRST], lay->reclen,
+	    lay->width[FIELD_FIRST], col, n);
+
+  ex->flow_seen += n;
+  ex->flow_cnt += n;
+}
+
+void interrupt(int sig)
+{
+  stop_f = TRUE;
+}
+
+/*
+ * Prints the statistics of all the workers combined.
+ */
+void cleanup(void)
+{
+  static const char *unit[] = { "flows", "PDUs", "bits" };
+  struct timeval now;
+  unsigned long flow_seen = 0L, pdu_sent = 0L;
+  double elapsed, rate = 0, units = 0, dev_sum = 0, dev_sq = 0, dev_max = 0;
+  double var;
+  long gaps = 0, nobufs = 0, again = 0, errs = 0, drops = 0;
+  u_int64_t t0 = 0, t1 = 0;
+  int i;
+
+  for (i=0; i < nworkers; i++) {
+    struct pacer *pc = &Ex[i].pc;
+
+    flow_seen += Ex[i].flow_seen;
+    pdu_sent += Ex[i].pdu_sent;
+    nobufs += Ex[i].err_nobufs;
+    again += Ex[i].err_again;
+    errs += Ex[i].err_other;
+    if (Ex[i].fc)
+      drops += Ex[i].fc->drops;
+
+    if (pc->rate > 0 && pc->last) {
+      if (!pc->prof)
+	rate += pc->rate;
+      units += pc->units - pc->last_cost;
+      if (!t0 || pc->t0 < t0)
+	t0 = pc->t0;
+      if (pc->last > t1)
+	t1 = pc->last;
+      gaps += pc->gaps;
+      dev_sum += pc->dev_sum;
+      dev_sq += pc->dev_sq;
+      if (pc->dev_max > dev_max)
+	dev_max = pc->dev_max;
+    }
+  }
+
+  fprintf(stderr, "\n%lu flows seen, %lu PDUs sent ", flow_seen, pdu_sent);
+
+  gettimeofday(&now, (struct timezone *)0);
+  elapsed = (now.tv_sec - Ex[0].start.tv_sec) +
+    (now.tv_usec - Ex[0].start.tv_usec) / 1000000.0;
+  fprintf(stderr, "(session rate = %lu/sec)\n",
+	  elapsed > 0 ? (unsigned long)(flow_seen / elapsed) : 0L);
+  if (nobufs || again || errs)
+    fprintf(stderr, "send errors: %ld ENOBUFS, %ld EAGAIN, %ld other\n",
+	    nobufs, again, errs);
+  if (drops)
+    fprintf(stderr, "%ld new flows found the flow cache full\n", drops);
+
+  if (Ex[0].pc.prof && t1 > t0)
+    rate = prof_units(Ex[0].pc.prof, (t1 - t0) / 1e9) * 1e9 / (t1 - t0);
+  if (rate > 0) {
+    /* units released before the last batch went out by t1 */
+    fprintf(stderr, "target rate = %.0f %s/sec, achieved = %.0f %s/sec\n",
+	    rate, unit[Ex[0].pc.unit],
+	    t1 > t0 ? units * 1e9 / (t1 - t0) : 0.0, unit[Ex[0].pc.unit]);
+    if (gaps) {
+      var = dev_sq / gaps - (dev_sum / gaps) * (dev_sum / gaps);
+      fprintf(stderr, "inter-PDU jitter = %.2f usec (rms), %.2f usec (max)\n",
+	      var > 0 ? sqrt(var) / 1000.0 : 0.0, dev_max / 1000.0);
+    }
+  }
+}
+
+
+/*
+ * Reads the flow profiles of a scenario file into scn:
+
+   # comment
+   [name] weight
+   field expression
+   ...
+
+ * where field is one of those of --fields. A profile has the
+ * expressions of the command line for the fields it does not give.
+ */
+void read_scenario(FILE *fp, struct scenario *scn)
+{
+  struct flow_prof *p = NULL;
+  double weight[MAX_PROFILES];
+  char line[1024], msg[1100], field[32], *s, *e;
+  void *ep;
+  int lineno = 0, f, i;
+
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if ((s = strchr(line, '#')) != NULL)
+      *s = '\0';
+    for (s = line; *s == ' ' || *s == '\t'; s++)
+      ;
+    for (e = s + strlen(s); e > s && strchr(" \t\r\n", e[-1]); e--)
+      ;
+    *e = '\0';
+    if (*s == '\0')
+      continue;
+
+    if (*s == '[') {
+      if (scn->nprof == MAX_PROFILES) {
+	snprintf(msg, sizeof(msg), "line %d: more than %d profiles",
+		 lineno, MAX_PROFILES);
+	fatal(msg);
+      }
+      p = &scn->prof[scn->nprof];
+      p->weight = 1;
+      if ((e = strchr(s, ']')) == NULL || e - s - 1 >= sizeof(p->name) ||
+	  (e[1] && sscanf(e + 1, "%lf", &p->weight) != 1) || p->weight < 0) {
+	snprintf(msg, sizeof(msg), "line %d: invalid profile: %s", lineno, s);
+	fatal(msg);
+      }
+      memcpy(p->name, s + 1, e - s - 1);
+      memcpy(&p->fx, &scenario_fx, sizeof(p->fx));
+      scn->nprof++;
+      continue;
+    }
+
+    if (sscanf(s, "%31s", field) != 1 || p == NULL) {
+      snprintf(msg, sizeof(msg), "line %d: no profile for %s", lineno, s);
+      fatal(msg);
+    }
+    for (f=0; f < NUM_FIELDS; f++)
+      if (!strcmp(field, fields[f].name))
+	break;
+    for (s += strlen(field); *s == ' ' || *s == '\t'; s++)
+      ;
+    if (f == NUM_FIELDS || *s == '\0') {
+      snprintf(msg, sizeof(msg), "line %d: invalid field: %s", lineno, field);
+      fatal(msg);
+    }
+    ep = (u_int8_t *)&p->fx + fields[f].expr;
+    if (p->own & 1 << f) {
+      if (fields[f].addr)
+	free_addr_expr(ep);
+      else
+	free_expr(ep);
+    }
+    /*
+     * Owned before it is compiled, so that what it has allocated by a
+     * failure is freed with the scenario.
+     */
+    memset(ep, 0, fields[f].addr ? sizeof(ipaddr_expr_t) :
+	   sizeof(val_expr_t));
+    p->own |= 1 << f;
+    if (fields[f].addr)
+      compile_ipaddr_expr(s, ep);
+    else
+      compile_expr(s, ep);
+  }
+
+  if (scn->nprof == 0)
+    fatal("no profile in scenario");
+  if ((scn->pick.vals = malloc(sizeof(long) * scn->nprof)) == NULL)
+    fatal("out of memory");
+  for (i=0; i < scn->nprof; i++) {
+    scn->pick.vals[i] = i;
+    weight[i] = scn->prof[i].weight;
+  }
+  scn->pick.mode = EXPR_TYPE_PRB;
+  scn->pick.nvals = scn->nprof;
+  build_alias(&scn->pick, weight, scn->nprof);
+}
+
+/*
+ * Loads the scenario file and hands it over to all the workers, which
+ * switch to it at their next records. An error in the file is fatal
+ * at start; on a reload, the previous scenario is kept.
+ */
+void load_scenario(int again_f)
+{
+  struct scenario *scn, *old;
+  jmp_buf jb;
+  FILE *fp;
+  int i;
+
+  if ((scn = calloc(1, sizeof(*scn))) == NULL ||
+      (scn->prof = calloc(MAX_PROFILES, sizeof(struct flow_prof))) == NULL)
+    fatal("out of memory");
+  if ((fp = fopen(scenario_file, "r")) == NULL) {
+    perror(scenario_file);
+    if (!again_f)
+      exit(1);
+    free_scenario(scn);
+    return;
+  }
+
+  if (again_f) {
+    if (setjmp(jb)) {
+      fatal_jmp = NULL;
+      fclose(fp);
+      free_scenario(scn);
+      fprintf(stderr, "%s: keeping the previous scenario\n", scenario_file);
+      return;
+    }
+    fatal_jmp = &jb;
+  }
+  read_scenario(fp, scn);
+  fatal_jmp = NULL;
+  fclose(fp);
+
+  if (again_f)
+    fprintf(stderr, "%s: %d profiles loaded\n", scenario_file, scn->nprof);
+  for (i=0; debug && i < scn->nprof; i++)
+    fprintf(stderr, "  [%s] %g, %d fields\n", scn->prof[i].name,
+	    scn->prof[i].weight, __builtin_popcount(scn->prof[i].own));
+
+  scn->users = nworkers;
+  for (i=0; i < nworkers; i++) {
+    old = __atomic_exchange_n(&Ex[i].next_scn, scn, __ATOMIC_RELEASE);
+    /* one the worker has not switched to yet */
+    if (old && __atomic_sub_fetch(&old->users, 1, __ATOMIC_ACQ_REL) == 0)
+      free_scenario(old);
+  }
+}
+
+void hangup(int sig)
+{
+  reload_f = TRUE;
+}
+
+static inline void check_reload(void)
+{
+  if (reload_f) {
+    reload_f = FALSE;
+    load_scenario(TRUE);
+  }
+}
+
+/*
+ * Waits for the workers to be done, reloading the scenario on SIGHUP,
+ * when there are no stats to wake up for.
+ */
+void watch_scenario(void)
+{
+  struct timespec ts = { 0, 100000000 };
+  int i = 0;
+
+  while (i < nworkers && !stop_f) {
+    if (Ex[i].done_f) {
+      i++;
+      continue;
+    }
+    nanosleep(&ts, NULL);
+    check_reload();
+  }
+}
+
+
+/*
+ * Takes a snapshot of the counters of a worker.
+ */
+static void snap_stats(struct flow_exporter *ex, struct stats *st)
+{
+  st->flows = ex->flow_seen;
+  st->pdus = ex->pdu_sent;
+  st->octets = ex->octets_sent;
+  st->nobufs = ex->err_nobufs;
+  st->again = ex->err_again;
+  st->errs = ex->err_other;
+  st->units = ex->pc.units;
+}
+
+/*
+ * Prints the rates over the last interval every ivl_ns, as a line of
+ * text or a JSON object, until all the workers are done. Rates are of
+ * the interval, error counts are since the start.
+ */
+void report_stats(u_int64_t ivl_ns)
+{
+  static const char *unit[] = { "flows", "PDUs", "bits" };
+  struct rate_prof *rp = Ex[0].pc.prof;
+  struct stats *prev, *cur, tot;
+  struct timespec ts;
+  u_int64_t t0, last, next, now, pt0;
+  double sec, target = 0;
+  int done, i;
+
+  prev = calloc(nworkers, sizeof(struct stats));
+  cur = calloc(nworkers, sizeof(struct stats));
+  if (!prev || !cur)
+    fatal("out of memory");
+  for (i=0; i < nworkers; i++)
+    target += Ex[i].pc.rate;
+
+  t0 = last = next = now_ns();
+  do {
+    next += ivl_ns;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0
+	   && !stop_f)
+      check_reload();	/* woken up by SIGHUP */
+    check_reload();	/* or it came in between */
+    if (stop_f)
+      break;
+    now = now_ns();
+    sec = (now - last) / 1e9;
+    /* the mean of the profile over the interval */
+    if (rp && (pt0 = Ex[0].pc.t0) != 0 && now > pt0)
+      target = (prof_units(rp, (now - pt0) / 1e9) -
+		prof_units(rp, last > pt0 ? (last - pt0) / 1e9 : 0)) / sec;
+    last = now;
+
+    done = TRUE;
+    memset(&tot, 0, sizeof(tot));
+    for (i=0; i < nworkers; i++) {
+      if (!Ex[i].done_f)
+	done = FALSE;
+      snap_stats(&Ex[i], &cur[i]);
+      tot.flows += cur[i].flows - prev[i].flows;
+      tot.pdus += cur[i].pdus - prev[i].pdus;
+      tot.octets += cur[i].octets - prev[i].octets;
+      tot.units += cur[i].units - prev[i].units;
+      tot.nobufs += cur[i].nobufs;
+      tot.again += cur[i].again;
+      tot.errs += cur[i].errs;
+    }
+
+    if (json_f) {
+      printf("{\"time\":%.3f,\"flows_per_sec\":%.0f,\"pdus_per_sec\":%.0f,"
+	     "\"bytes_per_sec\":%.0f,\"enobufs\":%ld,\"eagain\":%ld,"
+	     "\"errors\":%ld", (now - t0) / 1e9, tot.flows / sec,
+	     tot.pdus / sec, tot.octets / sec, tot.nobufs, tot.again,
+	     tot.errs);
+      if (target > 0 || rp)
+	printf(",\"rate_unit\":\"%s\",\"target\":%.0f,\"achieved\":%.0f",
+	       unit[Ex[0].pc.unit], target, tot.units / sec);
+      printf(",\"threads\":[");
+      for (i=0; i < nworkers; i++)
+	printf("%s{\"id\":%d,\"flows_per_sec\":%.0f,\"pdus_per_sec\":%.0f,"
+	       "\"bytes_per_sec\":%.0f,\"enobufs\":%ld,\"eagain\":%ld,"
+	       "\"errors\":%ld}", i ? "," : "", i,
+	       (cur[i].flows - prev[i].flows) / sec,
+	       (cur[i].pdus - prev[i].pdus) / sec,
+	       (cur[i].octets - prev[i].octets) / sec,
+	       cur[i].nobufs, cur[i].again, cur[i].errs);
+      printf("]}\n");
+    } else {
+      printf("%8.1fs: %.0f flows/s, %.0f PDUs/s, %.2f Mbytes/s",
+	     (now - t0) / 1e9, tot.flows / sec, tot.pdus / sec,
+	     tot.octets / sec / 1e6);
+      if (target > 0)
+	printf(", achieved %.0f of %.0f %s/s (%+.2f%%)",
+	       tot.units / sec, target, unit[Ex[0].pc.unit],
+	       (tot.units / sec - target) * 100 / target);
+      else if (rp)
+	printf(", achieved %.0f of 0 %s/s", tot.units / sec,
+	       unit[Ex[0].pc.unit]);
+      if (tot.nobufs || tot.again || tot.errs)
+	printf(", errors: %ld ENOBUFS, %ld EAGAIN, %ld other",
+	       tot.nobufs, tot.again, tot.errs);
+      printf("\n");
+      for (i=0; debug && nworkers > 1 && i < nworkers; i++)
+	printf("  thread %d: %.0f flows/s, %.0f PDUs/s, %.2f Mbytes/s\n", i,
+	       (cur[i].flows - prev[i].flows) / sec,
+	       (cur[i].pdus - prev[i].pdus) / sec,
+	       (cur[i].octets - prev[i].octets) / sec / 1e6);
+    }
+    fflush(stdout);
+    memcpy(prev, cur, nworkers * sizeof(struct stats));
+  } while (!done);
+
+  free(prev);
+  free(cur);
+}
+
+
+/*
+ * Receiver (--listen)
+ */
+void listen_open(struct flow_listener *lx, const char *addr, u_int16_t port,
+		 int reuse_f)
+{
+  struct sockaddr_in sin;
+  struct timeval tv;
+  int on = 1, rcvbuf = 32 << 20;
+  int i;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  if (!inet_aton(addr, &sin.sin_addr))
+    fatal("invalid listen address");
+
+  if ((lx->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    perror("socket");
+    exit(1);
+  }
+  if (reuse_f &&
+      setsockopt(lx->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+    perror("SO_REUSEPORT");
+    exit(1);
+  }
+  /* as large as the kernel lets it be (net.core.rmem_max) */
+  setsockopt(lx->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  /* wake up now and then to see stop_f */
+  tv.tv_sec = 0;
+  tv.tv_usec = 100000;
+  setsockopt(lx->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (bind(lx->sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+
+  lx->buf = malloc((size_t)LISTEN_BATCH * MAX_MTU);
+  lx->streams = calloc(2 * LISTEN_STREAMS, sizeof(struct lstream));
+  if (!lx->buf || !lx->streams)
+    fatal("out of memory");
+  for (i=0; i < LISTEN_BATCH; i++) {
+    lx->iov[i].iov_base = lx->buf + i * MAX_MTU;
+    lx->iov[i].iov_len = MAX_MTU;
+    lx->msgs[i].msg_hdr.msg_iov = &lx->iov[i];
+    lx->msgs[i].msg_hdr.msg_iovlen = 1;
+    lx->msgs[i].msg_hdr.msg_name = &lx->from[i];
+  }
+}
+
+/*
+ * Returns the slot of an exporter, an unused one (engine == 0) if it is
+ * new, or NULL if there are too many of them already.
+ */
+static struct lstream *find_stream(struct flow_listener *lx, u_int32_t addr,
+				   u_int16_t port, u_int32_t engine)
+{
+  struct lstream *st;
+  u_int32_t h;
+
+  h = addr * 0x9e3779b1U ^ (((u_int32_t)port << 16) | engine) * 0x85ebca6bU;
+  for (h ^= h >> 15; ; h++) {
+    st = &lx->streams[h & (2 * LISTEN_STREAMS - 1)];
+    if (st->engine == 0)
+      return lx->nstreams < LISTEN_STREAMS ? st : NULL;
+    if (st->addr == addr && st->port == port && st->engine == engine)
+      return st;
+  }
+}
+
+/*
+ * Credits back the flows of a late PDU, [seq, seq + count), which are
+ * in the gaps of a stream, and returns how many there were.
+ */
+static u_int32_t fill_gaps(struct lstream *st, u_int32_t seq, int count)
+{
+  struct lgap *g;
+  u_int32_t filled = 0;
+  int32_t a, b, len;
+  int i;
+
+  for (i=0; i < st->ngaps; i++) {
+    g = &st->gaps[i];
+    /* relative to the gap, so that they may wrap around */
+    a = (int32_t)(seq - g->lo);
+    b = a + count;
+    len = (int32_t)(g->hi - g->lo);
+    if (b <= 0 || a >= len)
+      continue;
+    if (a < 0)
+      a = 0;
+    if (b > len)
+      b = len;
+    filled += b - a;
+
+    if (a > 0 && b < len) {
+      /* in the middle: split it if there is room, or keep the front */
+      if (st->ngaps < LISTEN_GAPS) {
+	memmove(g + 2, g + 1, sizeof(*g) * (st->ngaps - i - 1));
+	g[1].lo = g->lo + b;
+	g[1].hi = g->hi;
+	st->ngaps++;
+	i++;
+      }
+      g->hi = g->lo + a;
+    } else if (a > 0)
+      g->hi = g->lo + a;
+    else if (b < len)
+      g->lo += b;
+    else {
+      memmove(g, g + 1, sizeof(*g) * (st->ngaps - i - 1));
+      st->ngaps--;
+      i--;
+    }
+  }
+  return filled;
+}
+
+/*
+ * Checks a V5 PDU and its flow_sequence against the last one of the
+ * same exporter. A gap counts as lost flows until late PDUs fill it
+ * in; only the oldest LISTEN_GAPS are kept track of. A PDU behind but
+ * not in a gap is a duplicate, or came before the first one, unless
+ * LISTEN_RESTART of them go on in a row, or it is far behind: then the
+ * exporter has started over.
+ */
+static void recv_pdu(struct flow_listener *lx, const u_int8_t *buf, int len,
+		     const struct sockaddr_in *from)
+{
+  struct nf_v5_hdr hdr;
+  struct nf_v5_rec rec;
+  struct lstream *st;
+  u_int32_t seq, up, engine;
+  int count, d, i;
+
+  lx->pdus++;
+  lx->octets += len;
+  if (len < sizeof(hdr)) {
+    lx->bad++;
+    return;
+  }
+  memcpy(&hdr, buf, sizeof(hdr));
+  count = ntohs(hdr.count);
+  if (ntohs(hdr.version) != NF_VERSION_V5 || count > NF5_MAX_FLOWREC ||
+      len < sizeof(hdr) + count * sizeof(rec)) {
+    lx->bad++;
+    return;
+  }
+  lx->flows += count;
+
+  up = ntohl(hdr.sysup_time);
+  for (i=0; i < count; i++) {
+    memcpy(&rec, buf + sizeof(hdr) + i * sizeof(rec), sizeof(rec));
+    if ((int32_t)(ntohl(rec.last) - ntohl(rec.first)) < 0 ||
+	(int32_t)(up - ntohl(rec.last)) < 0)
+      lx->skewed++;
+  }
+
+  seq = ntohl(hdr.flow_sequence);
+  engine = ((hdr.engine_type << 8) | hdr.engine_id) + 1;
+  st = find_stream(lx, from->sin_addr.s_addr, from->sin_port, engine);
+  if (st == NULL) {
+    lx->untracked++;
+    return;
+  }
+  if (st->engine == 0) {
+    st->addr = from->sin_addr.s_addr;
+    st->port = from->sin_port;
+    st->engine = engine;
+    st->next = seq + count;
+    lx->nstreams++;
+    return;
+  }
+
+  d = (int32_t)(seq - st->next);
+  if (d >= 0) {
+    if (d > 0) {
+      lx->lost += d;
+      if (st->ngaps == LISTEN_GAPS) {
+	/* the oldest stays lost */
+	memmove(st->gaps, st->gaps + 1, sizeof(struct lgap) * --st->ngaps);
+      }
+      st->gaps[st->ngaps].lo = st->next;
+      st->gaps[st->ngaps].hi = seq;
+      st->ngaps++;
+    }
+    st->next = seq + count;
+    st->nredo = 0;
+    return;
+  }
+
+  if (d >= -LISTEN_WINDOW) {
+    d = fill_gaps(st, seq, count);
+    if (d > 0) {
+      lx->late++;
+      lx->lost -= d;
+      st->nredo = 0;
+      return;
+    }
+    lx->dups++;
+    st->nredo = st->nredo && seq == st->redo ? st->nredo + 1 : 1;
+    st->redo = seq + count;
+    if (st->nredo < LISTEN_RESTART)
+      return;
+    lx->dups -= st->nredo;	/* they were of the new run */
+  }
+
+  /* started over: what is missing of the old run stays lost */
+  lx->restarts++;
+  st->next = seq + count;
+  st->ngaps = 0;
+  st->nredo = 0;
+}
+
+void *run_listener(void *arg)
+{
+  struct flow_listener *lx = arg;
+  int i, n;
+
+#if defined (__linux__)
+  if (lx->cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(lx->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      fprintf(stderr, "listener %d: cannot pin to cpu %d\n", lx->id,
+	      lx->cpu);
+  }
+#endif
+
+  while (!stop_f) {
+    for (i=0; i < LISTEN_BATCH; i++)
+      lx->msgs[i].msg_hdr.msg_namelen = sizeof(lx->from[i]);
+    n = recvmmsg(lx->sock, lx->msgs, LISTEN_BATCH, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	continue;
+      perror("recvmmsg");
+      break;
+    }
+    for (i=0; i<n; i++)
+      recv_pdu(lx, lx->buf + i * MAX_MTU, lx->msgs[i].msg_len,
+	       &lx->from[i]);
+  }
+
+  lx->done_f = TRUE;
+  return NULL;
+}
+
+/*
+ * Adds up the counters of all the listeners.
+ */
+static void snap_listeners(struct flow_listener *tot)
+{
+  int i;
+
+  memset(tot, 0, sizeof(*tot));
+  for (i=0; i < nworkers; i++) {
+    tot->flows += Lx[i].flows;
+    tot->pdus += Lx[i].pdus;
+    tot->octets += Lx[i].octets;
+    tot->lost += Lx[i].lost;
+    tot->late += Lx[i].late;
+    tot->dups += Lx[i].dups;
+    tot->restarts += Lx[i].restarts;
+    tot->bad += Lx[i].bad;
+    tot->skewed += Lx[i].skewed;
+    tot->untracked += Lx[i].untracked;
+    tot->nstreams += Lx[i].nstreams;
+  }
+}
+
+static double loss_pct(struct flow_listener *l)
+{
+  return l->lost > 0 ? l->lost * 100.0 / (l->flows + l->lost) : 0.0;
+}
+
+/*
+ * Prints what has been received every ivl_ns until interrupted, as a
+ * line of text or a JSON object. Rates are of the interval, the loss
+ * and the reordering since the start, and the totals at the end.
+ */
+void report_listen(u_int64_t ivl_ns)
+{
+  struct flow_listener prev, cur;
+  struct timespec ts;
+  u_int64_t t0, last, next, now;
+  double sec;
+
+  memset(&prev, 0, sizeof(prev));
+  t0 = last = next = now_ns();
+  while (!stop_f) {
+    next += ivl_ns;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0
+	   && !stop_f)
+      ;
+    if (stop_f)
+      break;
+    now = now_ns();
+    sec = (now - last) / 1e9;
+    last = now;
+
+    snap_listeners(&cur);
+    if (json_f)
+      printf("{\"time\":%.3f,\"flows_per_sec\":%.0f,\"pdus_per_sec\":%.0f,"
+	     "\"bytes_per_sec\":%.0f,\"lost\":%ld,\"loss_pct\":%.4f,"
+	     "\"late\":%ld,\"dups\":%ld,\"bad\":%ld,\"skewed\":%ld,"
+	     "\"exporters\":%u}\n",
+	     (now - t0) / 1e9, (cur.flows - prev.flows) / sec,
+	     (cur.pdus - prev.pdus) / sec, (cur.octets - prev.octets) / sec,
+	     cur.lost, loss_pct(&cur), cur.late, cur.dups, cur.bad, cur.skewed,
+	     cur.nstreams);
+    else {
+      printf("%8.1fs: %.0f flows/s, %.0f PDUs/s, %.2f Mbytes/s, "
+	     "lost %ld (%.4f%%), late %ld, dup %ld", (now - t0) / 1e9,
+	     (cur.flows - prev.flows) / sec, (cur.pdus - prev.pdus) / sec,
+	     (cur.octets - prev.octets) / sec / 1e6, cur.lost, loss_pct(&cur),
+	     cur.late, cur.dups);
+      if (cur.bad || cur.skewed)
+	printf(", bad %ld, skewed %ld", cur.bad, cur.skewed);
+      printf("\n");
+    }
+    fflush(stdout);
+    memcpy(&prev, &cur, sizeof(cur));
+  }
+
+  snap_listeners(&cur);
+  fprintf(stderr, "\n%ld flows, %ld PDUs received from %u exporters\n",
+	  cur.flows, cur.pdus, cur.nstreams);
+  fprintf(stderr, "%ld flows lost (%.4f%%), %ld PDUs late, %ld duplicate "
+	  "or reordered\n", cur.lost, loss_pct(&cur), cur.late, cur.dups);
+  if (cur.restarts)
+    fprintf(stderr, "%ld exporters started over\n", cur.restarts);
+  if (cur.bad || cur.skewed || cur.untracked)
+    fprintf(stderr, "%ld PDUs not V5 or truncated, %ld records with skewed "
+	    "times, %ld PDUs of untracked exporters\n", cur.bad, cur.skewed,
+	    cur.untracked);
+}
+
+/*
+ * Binds nworkers listeners to addr and port.
+ */
+void open_listeners(const char *addr, u_int16_t port, const char *cpu)
+{
+  val_expr_t cpu_exp;
+  int i;
+
+  if ((Lx = calloc(nworkers, sizeof(struct flow_listener))) == NULL)
+    fatal("out of memory");
+  if (cpu)
+    compile_expr(cpu, &cpu_exp);
+  for (i=0; i < nworkers; i++) {
+    Lx[i].id = i;
+    Lx[i].cpu = cpu ? (int)expr_val(&cpu_exp) : -1;
+    listen_open(&Lx[i], addr, port, nworkers > 1);
+  }
+}
+
+void start_listeners(void)
+{
+  int i;
+
+  for (i=0; i < nworkers; i++)
+    if ((errno = pthread_create(&Lx[i].thread, NULL,
+				run_listener, &Lx[i])) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+}
+
+/*
+ * Runs the receiver on addr and port with nworkers threads, until
+ * interrupted.
+ */
+void run_listen(const char *addr, u_int16_t port, const char *cpu,
+		double ivl)
+{
+  struct sigaction sigact;
+  sigset_t sigs;
+  int i;
+
+  open_listeners(addr, port, cpu);
+  printf("listening on %s:%u, %d thread(s)\n", addr, port, nworkers);
+
+  memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_handler = interrupt;
+  sigaction(SIGINT, &sigact, NULL);
+
+  /* SIGINT should be delivered to the main thread only */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  start_listeners();
+  pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+  report_listen((u_int64_t)((ivl > 0 ? ivl : 1) * 1e9));
+
+  for (i=0; i < nworkers; i++)
+    pthread_join(Lx[i].thread, NULL);
+}
+
+
+/*
+ * Sweep (--sweep)
+ */
+
+/* at most this many steps */
+#define SWEEP_STEPS	64
+/* a step falling short of its target by this much is saturated */
+#define SWEEP_SHORTFALL	0.02
+/* and so is one with as many send errors per PDU, or flows lost */
+#define SWEEP_LOSS	0.001
+
+/*
+ * Makes a profile which starts at rate and goes up by factor every
+ * hold seconds.
+ */
+void sweep_prof(struct rate_prof *rp, double rate, double factor,
+		double hold)
+{
+  int k;
+
+  memset(rp, 0, sizeof(*rp));
+  rp->t = malloc(sizeof(double) * 2 * SWEEP_STEPS);
+  rp->r = malloc(sizeof(double) * 2 * SWEEP_STEPS);
+  if (!rp->t || !rp->r)
+    fatal("out of memory");
+  for (k=0; k < SWEEP_STEPS; k++, rate *= factor) {
+    rp->t[2 * k] = k * hold;
+    rp->t[2 * k + 1] = (k + 1) * hold;
+    rp->r[2 * k] = rp->r[2 * k + 1] = rate;
+  }
+  rp->npts = 2 * SWEEP_STEPS;
+}
+
+static u_int64_t worker_cpu_ns(void)
+{
+  struct timespec ts;
+  clockid_t cid;
+  u_int64_t sum = 0;
+  int i;
+
+  for (i=0; i < nworkers; i++)
+    if (!__atomic_load_n(&Ex[i].done_f, __ATOMIC_ACQUIRE) &&
+	pthread_getcpuclockid(Ex[i].thread, &cid) == 0 &&
+	clock_gettime(cid, &ts) == 0)
+      sum += ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    else if (__atomic_load_n(&Ex[i].done_f, __ATOMIC_ACQUIRE))
+      sum += Ex[i].cpu_ns;	/* what it took before it finished */
+  return sum;
+}
+
+/*
+ * Measures each step of the sweep profile as it is held: the rate
+ * achieved, the send errors, the CPU time the workers spent per flow
+ * and, with the listeners (--listen) running, what they lost. Stops at
+ * the first step which is saturated, the knee, and prints the table as
+ * it goes, and as CSV to file too if any.
+ */
+void run_sweep(struct rate_prof *rp, const char *file)
+{
+  static const char *unit[] = { "flows", "PDUs", "bits" };
+  struct stats cur, prev;
+  struct flow_listener lcur, lprev;
+  struct timespec ts;
+  u_int64_t t0, next, cpu, pcpu, pt;
+  double hold = rp->t[1], sec, target, achieved, lost = 0, best = 0;
+  long flows, errs;
+  const char *why;
+  FILE *fp = NULL;
+  int knee = 0, k, i;
+
+  if (file && (fp = fopen(file, "w")) == NULL) {
+    perror(file);
+    exit(1);
+  }
+  if (fp) {
+    fprintf(fp, "step,target,achieved,unit,flows_per_sec,pdus_per_sec,"
+	    "send_errors,cpu_ns_per_flow,cpu_pct");
+    if (Lx)
+      fprintf(fp, ",recv_flows_per_sec,lost,loss_pct");
+    fprintf(fp, ",saturated\n");
+  }
+  printf("%4s %12s %12s %12s %10s %10s %7s", "step", "target",
+	 "achieved", "PDUs/s", "errors", "ns/flow", "cpu%");
+  if (Lx)
+    printf(" %12s %10s %8s", "received/s", "lost", "loss%");
+  printf("  (%s/s)\n", unit[Ex[0].pc.unit]);
+
+  /* the workers start the profile when they start */
+  while ((t0 = Ex[0].pc.t0) == 0 && !Ex[0].done_f && !stop_f)
+    usleep(1000);
+  memset(&prev, 0, sizeof(prev));
+  memset(&lcur, 0, sizeof(lcur));
+  memset(&lprev, 0, sizeof(lprev));
+  pcpu = worker_cpu_ns();
+  pt = t0;
+
+  for (k=0; k < SWEEP_STEPS && !stop_f; k++) {
+    next = t0 + (u_int64_t)((k + 1) * hold * 1e9);
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0
+	   && !stop_f)
+      check_reload();	/* woken up by SIGHUP */
+    check_reload();	/* or it came in between */
+    if (stop_f)
+      break;
+
+    memset(&cur, 0, sizeof(cur));
+    for (i=0; i < nworkers; i++) {
+      struct stats st;
+
+      snap_stats(&Ex[i], &st);
+      cur.flows += st.flows;
+      cur.pdus += st.pdus;
+      cur.nobufs += st.nobufs;
+      cur.again += st.again;
+      cur.errs += st.errs;
+      cur.units += st.units;
+    }
+    cpu = worker_cpu_ns();
+    if (cpu < pcpu)
+      cpu = pcpu;	/* a worker caught as it exited */
+    next = now_ns();
+    sec = (next - pt) / 1e9;
+    target = rp->r[2 * k];
+    achieved = (cur.units - prev.units) / sec;
+    flows = cur.flows - prev.flows;
+    errs = (cur.nobufs + cur.again + cur.errs) -
+      (prev.nobufs + prev.again + prev.errs);
+    if (Lx) {
+      snap_listeners(&lcur);
+      lost = lcur.lost - lprev.lost;
+    }
+
+    why = NULL;
+    if (achieved < target * (1 - SWEEP_SHORTFALL))
+      why = "rate";
+    else if (errs > (cur.pdus - prev.pdus) * SWEEP_LOSS)
+      why = "errors";
+    else if (Lx && lost > flows * SWEEP_LOSS)
+      why = "loss";
+
+    printf("%4d %12.0f %12.0f %12.0f %10ld %10.1f %7.1f", k + 1, target,
+	   achieved, (cur.pdus - prev.pdus) / sec, errs,
+	   flows ? (double)(cpu - pcpu) / flows : 0.0,
+	   (cpu - pcpu) / sec / 1e7);
+    if (Lx)
+      printf(" %12.0f %10.0f %8.4f", (lcur.flows - lprev.flows) / sec,
+	     lost, flows ? lost * 100 / flows : 0.0);
+    printf("%s%s\n", why ? "  <- " : "", why ? why : "");
+    fflush(stdout);
+    if (fp) {
+      fprintf(fp, "%d,%.0f,%.0f,%s,%.0f,%.0f,%ld,%.1f,%.1f", k + 1,
+	      target, achieved, unit[Ex[0].pc.unit], flows / sec,
+	      (cur.pdus - prev.pdus) / sec, errs,
+	      flows ? (double)(cpu - pcpu) / flows : 0.0,
+	      (cpu - pcpu) / sec / 1e7);
+      if (Lx)
+	fprintf(fp, ",%.0f,%.0f,%.4f", (lcur.flows - lprev.flows) / sec,
+		lost, flows ? lost * 100 / flows : 0.0);
+      fprintf(fp, ",%s\n", why ? why : "");
+    }
+
+    if (why) {
+      knee = k + 1;
+      break;
+    }
+    best = target;
+    memcpy(&prev, &cur, sizeof(cur));
+    memcpy(&lprev, &lcur, sizeof(lcur));
+    pcpu = cpu;
+    pt = next;
+  }
+  stop_f = TRUE;	/* the workers, and the listeners */
+
+  if (knee > 1)
+    printf("knee at step %d: up to %.0f %s/s sustained\n", knee, best,
+	   unit[Ex[0].pc.unit]);
+  else if (knee)
+    printf("saturated at the first step already\n");
+  else if (best > 0)
+    printf("no knee up to %.0f %s/s\n", best, unit[Ex[0].pc.unit]);
+  if (fp)
+    fclose(fp);
+}
+
+void init_exporter(struct flow_exporter *ex, const char *dst, u_int16_t port,
+		   u_int32_t flowrec_count, int batch_size, int gso_f)
+{
+  int i;
+
+  gettimeofday(&ex->start, (struct timezone *)0);
+
+  /* XXX: assumes dst is in XXX.XXX.XXX.XXX format */
+  inet_aton(dst, &ex->collector);
+
+  ex->port = port;
+
+  if ((ex->sock = socket(PF_INET, tcp_f ? SOCK_STREAM : SOCK_DGRAM, 0)) == -1) {
+    perror("socket");
+    exit(1);
+  }
+
+  memset(&ex->to, 0, sizeof(ex->to));
+  ex->to.sin_family = AF_INET;
+  ex->to.sin_port = htons(port);
+  memcpy(&ex->to.sin_addr, &ex->collector, sizeof(ex->collector));
+
+  if (tcp_f && !nosend_f &&
+      connect(ex->sock, (struct sockaddr *)&ex->to, sizeof(ex->to)) == -1) {
+    perror("connect");
+    exit(1);
+  }
+
+  ex->flow_seen = 0L;
+  ex->pdu_sent = 0L;
+  ex->vx = &ex->self;
+  ex->flow_cnt = 0;
+  ex->bucket_size = flowrec_count;
+
+  ex->batch_size = batch_size;
+  ex->batch_cnt = 0;
+  ex->slot_size = mtu - IP_UDP_HDRLEN;
+  ex->batch_buf = malloc(ex->slot_size * batch_size);
+  ex->iov = calloc(batch_size, sizeof(struct iovec));
+  ex->msgs = calloc(batch_size, sizeof(struct mmsghdr));
+  ex->src = calloc(batch_size, sizeof(u_int32_t));
+  ex->stamp = calloc(batch_size, sizeof(u_int64_t));
+  if (!ex->batch_buf || !ex->iov || !ex->msgs || !ex->src || !ex->stamp)
+    fatal("out of memory");
+
+  for (i=0; i < batch_size; i++) {
+    ex->iov[i].iov_base = ex->batch_buf + i * ex->slot_size;
+    ex->msgs[i].msg_hdr.msg_name = &ex->to;
+    ex->msgs[i].msg_hdr.msg_namelen = sizeof(ex->to);
+    ex->msgs[i].msg_hdr.msg_iov = &ex->iov[i];
+    ex->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  ex->gso_f = FALSE;
+#ifdef UDP_SEGMENT
+  if (gso_f && batch_size > 1 && !tcp_f) {
+    int gso_size;
+    socklen_t len = sizeof(gso_size);
+
+    /* probe whether the kernel knows UDP_SEGMENT at all */
+    if (getsockopt(ex->sock, SOL_UDP, UDP_SEGMENT, &gso_size, &len) == 0)
+      ex->gso_f = TRUE;
+  }
+#endif
+}
+
+
+/*
+ * Sets the header fields of a PDU slot which never change, once.
+ */
+void init_hdr(struct flow_exporter *ex, u_int8_t *buf)
+{
+  struct nf_v5_hdr *hdr = (struct nf_v5_hdr *)buf;
+  struct nf_v9_hdr *hdr9 = (struct nf_v9_hdr *)buf;
+  struct ipfix_hdr *ih = (struct ipfix_hdr *)buf;
+
+  switch (nf_version) {
+  case NF_VERSION_IPFIX:
+    memset(ih, 0, sizeof(*ih));
+    ih->version = htons(NF_VERSION_IPFIX);
+    break;
+  case NF_VERSION_V9:
+    memset(hdr9, 0, sizeof(*hdr9));
+    hdr9->version = htons(NF_VERSION_V9);
+    break;
+  default:
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = htons(NF_VERSION_V5);
+    hdr->sampling = htons(0);
+    break;
+  }
+  if (ex->hdr_static)
+    set_source(ex, buf);
+}
+
+/*
+ * Allocates an arena of size octets, backed by huge pages if possible.
+ */
+u_int8_t *alloc_pool(size_t size)
+{
+  void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  size_t hsize = (size + (2 << 20) - 1) & ~(size_t)((2 << 20) - 1);
+
+  p = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+	   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, size, MADV_HUGEPAGE);	/* transparent huge pages then */
+#endif
+  }
+  return p;
+}
+
+#if defined (__linux__)
+/*
+ * Asks the kernel whether it knows IORING_OP_SEND_ZC, before any PDU
+ * is sent with it.
+ */
+static int uring_has_zc(int fd)
+{
+  struct io_uring_probe *probe;
+  int ok;
+
+  if ((probe = calloc(1, sizeof(*probe) +
+		      256 * sizeof(struct io_uring_probe_op))) == NULL)
+    fatal("out of memory");
+  ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	       probe, 256) == 0 && probe->last_op >= IORING_OP_SEND_ZC &&
+    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+/*
+ * Sets up an io_uring instance for the worker's socket.
+ * The PDU slots move into URING_GROUPS groups of batch_size, registered
+ * as a fixed buffer, so that a batch can be generated into one group
+ * while the others are still being sent.
+ */
+void uring_open(struct flow_exporter *ex)
+{
+  struct io_uring_params p;
+  struct uring *ur;
+  struct iovec iov;
+  u_int8_t *sq, *cq;
+  size_t sq_len, cq_len;
+  int i;
+
+  if ((ur = calloc(1, sizeof(*ur))) == NULL)
+    fatal("out of memory");
+
+  memset(&p, 0, sizeof(p));
+  if ((ur->fd = syscall(__NR_io_uring_setup,
+			URING_GROUPS * ex->batch_size, &p)) == -1) {
+    perror("io_uring_setup");
+    exit(1);
+  }
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+    sq_len = cq_len;
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ur->fd, IORING_OFF_SQ_RING);
+  cq = sq;
+  if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+	      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+  ur->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ur->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ur->sqes == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  ur->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ur->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ur->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ur->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ur->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ur->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  ur->slots_len = URING_GROUPS * ex->batch_size * ex->slot_size;
+  ur->slots = alloc_pool(ur->slots_len);
+  for (i=0; i < URING_GROUPS * ex->batch_size; i++)
+    init_hdr(ex, ur->slots + i * ex->slot_size);
+  for (i=0; i < ex->batch_size; i++)
+    ex->iov[i].iov_base = ur->slots + i * ex->slot_size;
+  free(ex->batch_buf);
+  ex->batch_buf = NULL;
+
+  iov.iov_base = ur->slots;
+  iov.iov_len = ur->slots_len;
+  ur->fixed_f = syscall(__NR_io_uring_register, ur->fd,
+			IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  if (!ur->fixed_f && debug)
+    perror("IORING_REGISTER_BUFFERS");
+  ur->zc_f = uring_has_zc(ur->fd);
+  if (!ur->zc_f && debug)
+    fprintf(stderr, "IORING_OP_SEND_ZC not available\n");
+
+  /* IORING_OP_SEND takes a destination only from 6.0 on, with SEND_ZC */
+  if (!ur->zc_f &&
+      connect(ex->sock, (struct sockaddr *)&ex->to, sizeof(ex->to)) == -1) {
+    perror("connect");
+    exit(1);
+  }
+
+  ex->ur = ur;
+}
+#endif
+
+/*
+ * Generates ex->pool_size complete PDUs into the pool.
+ */
+void prerender(struct flow_exporter *ex)
+{
+  long i;
+
+  ex->pool = alloc_pool(ex->pool_size * ex->slot_size);
+  ex->pool_len = malloc(sizeof(u_int16_t) * ex->pool_size);
+  ex->pool_cnt = malloc(sizeof(u_int16_t) * ex->pool_size);
+  if (!ex->pool_len || !ex->pool_cnt)
+    fatal("out of memory");
+
+  for (i=0; i < ex->pool_size && !stop_f; i++) {
+    u_int8_t *pdu = ex->pool + i * ex->slot_size;
+
+    ex->iov[0].iov_base = pdu;
+    init_hdr(ex, pdu);
+    gen_flows(ex, ex->bucket_size);
+    ex->pool_len[i] = fill_hdr(ex, pdu, ex->flow_cnt);
+    ex->pool_cnt[i] = ex->flow_cnt;
+    ex->flow_cnt = 0;
+  }
+  ex->flow_seen = 0;
+  ex->self.flows = 0;
+  ex->self.pdus = 0;
+}
+
+/*
+ * Publishes how far the worker has got in the capture, and lets go of
+ * the chunk ending at end once every worker still replaying is past it.
+ * Whichever worker gets past it last sees the others' positions.
+ */
+static void pcap_in_pass(struct flow_exporter *ex, u_int64_t pos, u_int64_t end,
+			 size_t chunk)
+{
+  struct pcap_in *pin = ex->pin;
+  int i;
+
+  __atomic_store_n(&pin->pos[ex->id], pos, __ATOMIC_SEQ_CST);
+  for (i=0; i < nworkers; i++)
+    if (__atomic_load_n(&pin->pos[i], __ATOMIC_SEQ_CST) < end)
+      return;
+  madvise((void *)(pin->map + chunk), PCAP_IN_CHUNK, MADV_DONTNEED);
+}
+
+/*
+ * Replays the V5 PDUs of the capture, every nworkers-th one from the
+ * worker's own on, at the original timing scaled by pin->speed or as
+ * fast as possible. Each PDU is stamped with the time it is sent, the
+ * first and last switched times of its records are moved along with
+ * its uptime, and its flow_sequence follows on from the PDUs sent
+ * before with the same engine_type and engine_id. The capture is
+ * replayed over again until ex->count flows, if given, are sent.
+ */
+void replay_pcap(struct flow_exporter *ex)
+{
+  struct pcap_in *pin = ex->pin;
+  struct pcap_pkt_hdr ph;
+  struct nf_v5_hdr *hdr;
+  struct nf_v5_rec *rec;
+  struct timespec ts;
+  const u_int8_t *pdu;
+  u_int8_t *buf;
+  u_int64_t t, t0 = 0, ts0 = 0, due;
+  u_int32_t up, engine;
+  unsigned long n = 0, idx, pass = 0;
+  size_t off, done;
+  int len, count, i, sent_f;
+
+  do {
+    sent_f = FALSE;
+    idx = 0;
+    done = 0;
+    for (off = sizeof(struct pcap_file_hdr);
+	 off + sizeof(ph) <= pin->size && !stop_f; off += ph.caplen) {
+      memcpy(&ph, pin->map + off, sizeof(ph));
+      off += sizeof(ph);
+      if (pin->swap_f) {
+	ph.ts_sec = __builtin_bswap32(ph.ts_sec);
+	ph.ts_frac = __builtin_bswap32(ph.ts_frac);
+	ph.caplen = __builtin_bswap32(ph.caplen);
+      }
+      if (ph.caplen > pin->size - off)
+	break;		/* cut short */
+
+      if (off - done >= 2 * PCAP_IN_CHUNK) {
+	pcap_in_pass(ex, pass * pin->size + off,
+		     pass * pin->size + done + PCAP_IN_CHUNK, done);
+	done += PCAP_IN_CHUNK;
+      }
+
+      if ((pdu = pcap_in_udp(pin, pin->map + off, ph.caplen, &len)) == NULL ||
+	  len < sizeof(*hdr) || len > ex->slot_size)
+	continue;
+      hdr = (struct nf_v5_hdr *)pdu;
+      count = ntohs(hdr->count);
+      if (ntohs(hdr->version) != NF_VERSION_V5 || count > NF5_MAX_FLOWREC ||
+	  len < sizeof(*hdr) + count * sizeof(*rec))
+	continue;
+      if (idx++ % nworkers != ex->id)
+	continue;
+
+      if (pin->speed > 0) {
+	t = ph.ts_sec * 1000000000ULL +
+	  (pin->nsec_f ? ph.ts_frac : ph.ts_frac * 1000ULL);
+	if (!sent_f) {
+	  t0 = now_ns();
+	  ts0 = t;
+	}
+	due = t0 + (u_int64_t)((t > ts0 ? t - ts0 : 0) / pin->speed);
+	if (due > now_ns()) {
+	  send_batch(ex);
+	  ts.tv_sec = due / 1000000000ULL;
+	  ts.tv_nsec = due % 1000000000ULL;
+	  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+      }
+      sent_f = TRUE;
+
+      buf = ex->iov[ex->batch_cnt].iov_base;
+      memcpy(buf, pdu, len);
+      hdr = (struct nf_v5_hdr *)buf;
+      if (ex->batch_cnt == 0)
+	ex->clk = clock_ns();
+      up = ntohl(hdr->sysup_time);
+      patch_time(buf, ex->clk, 0);
+      up = ntohl(hdr->sysup_time) - up;
+      for (i=0, rec = (struct nf_v5_rec *)(hdr + 1); i < count; i++, rec++) {
+	rec->first = htonl(ntohl(rec->first) + up);
+	rec->last = htonl(ntohl(rec->last) + up);
+      }
+      engine = (hdr->engine_type << 8) | hdr->engine_id;
+      hdr->flow_sequence = htonl(ex->pin_seq[engine]);
+      ex->pin_seq[engine] += count;
+
+      ex->iov[ex->batch_cnt].iov_len = len;
+      ex->stamp[ex->batch_cnt] = ex->clk;
+      ex->flow_seen += count;
+      ex->batch_flows += count;
+      if (++ex->batch_cnt == ex->batch_size)
+	send_batch(ex);
+      n += count;
+      if (ex->count && n >= ex->count)
+	break;
+    }
+    if (idx == 0 && !stop_f)
+      fatal("no NetFlow V5 PDUs to replay in pcap-in");
+    pass++;
+  } while (sent_f && ex->count && n < ex->count && !stop_f);
+
+  /* out of the way of the workers still replaying */
+  __atomic_store_n(&pin->pos[ex->id], UINT64_MAX, __ATOMIC_SEQ_CST);
+  send_batch(ex);
+}
+
+/*
+ * Sends the pre-rendered PDUs over and over. Only the header fields
+ * which must change are patched: the sequence number and the
+ * timestamps. V9 templates go out wherever they were rendered.
+ */
+void replay_pool(struct flow_exporter *ex)
+{
+  u_int8_t *pdu;
+  unsigned long n = 0;
+  long i = 0;
+  int cnt;
+
+  while (!stop_f && (!ex->count || n < ex->count)) {
+    pdu = ex->pool + i * ex->slot_size;
+    cnt = ex->pool_cnt[i];
+
+    ex->flow_seen += cnt;
+    ex->self.flows += cnt;
+    if (nf_version == NF_VERSION_IPFIX)
+      ((struct ipfix_hdr *)pdu)->sequence = htonl(ex->self.flows - cnt);
+    else if (nf_version == NF_VERSION_V9)
+      ((struct nf_v9_hdr *)pdu)->package_sequence = htonl(ex->self.pdus++);
+    else
+      ((struct nf_v5_hdr *)pdu)->flow_sequence = htonl(ex->self.flows - cnt);
+    if (ex->batch_cnt == 0)
+      ex->clk = clock_ns();
+    patch_time(pdu, ex->clk, 0);
+
+    ex->iov[ex->batch_cnt].iov_base = pdu;
+    ex->iov[ex->batch_cnt].iov_len = ex->pool_len[i];
+    ex->stamp[ex->batch_cnt] = ex->clk;
+    spoof_src(ex);
+    ex->batch_flows += cnt;
+    if (++ex->batch_cnt == ex->batch_size)
+      send_batch(ex);
+
+    n += cnt;
+    if (++i == ex->pool_size)
+      i = 0;
+  }
+  send_batch(ex);
+}
+
+/*
+ * Lays out the flow record, once for all the workers. V5 has a fixed
+ * record; V9 and IPFIX export the fields listed (comma-separated names,
+ * NULL for all of them) in the order of fields[], and the template set
+ * describing them is built here too.
+ */
+void layout_record(const char *list)
+{
+  struct rec_layout *lay = &layout;
+  struct nf_v9_set_hdr *set = (struct nf_v9_set_hdr *)tset;
+  u_int16_t *t = (u_int16_t *)(tset + sizeof(*set));
+  char buf[256], *p;
+  int export[NUM_FIELDS];
+  int f, n = 0;
+
+  if (nf_version == NF_VERSION_V5) {
+    lay->hdrlen = sizeof(struct nf_v5_hdr);
+    lay->reclen = sizeof(struct nf_v5_rec);
+    V5_FIELD(FIELD_SRCADDR, src_addr);
+    V5_FIELD(FIELD_DSTADDR, dst_addr);
+    V5_FIELD(FIELD_NEXTHOP, nexthop);
+    V5_FIELD(FIELD_INPUTIF, in_if);
+    V5_FIELD(FIELD_OUTPUTIF, out_if);
+    V5_FIELD(FIELD_PACKETS, packets);
+    V5_FIELD(FIELD_OCTETS, octets);
+    V5_FIELD(FIELD_FIRST, first);
+    V5_FIELD(FIELD_LAST, last);
+    V5_FIELD(FIELD_SRCPORT, src_port);
+    V5_FIELD(FIELD_DSTPORT, dst_port);
+    V5_FIELD(FIELD_TCPFLAGS, tcp_flags);
+    V5_FIELD(FIELD_PROTOCOL, ip_proto);
+    V5_FIELD(FIELD_TOS, tos);
+    V5_FIELD(FIELD_SRCAS, src_as);
+    V5_FIELD(FIELD_DSTAS, dst_as);
+    V5_FIELD(FIELD_SRCMASK, src_mask);
+    V5_FIELD(FIELD_DSTMASK, dst_mask);
+    return;
+  }
+
+  for (f=0; f < NUM_FIELDS; f++)
+    export[f] = (list == NULL);
+  if (list) {
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+      for (f=0; f < NUM_FIELDS; f++)
+	if (strcmp(p, fields[f].name) == 0)
+	  break;
+      if (f == NUM_FIELDS) {
+	fprintf(stderr, "unknown field: %s\n", p);
+	exit(1);
+      }
+      export[f] = TRUE;
+    }
+  }
+
+  lay->hdrlen = nf_version == NF_VERSION_IPFIX ?
+    sizeof(struct ipfix_hdr) : sizeof(struct nf_v9_hdr);
+  lay->reclen = 0;
+  t[0] = htons(NF9_TEMPLATE_ID);
+  t += 2;
+  for (f=0; f < NUM_FIELDS; f++) {
+    lay->off[f] = -1;
+    if (!export[f])
+      continue;
+    lay->off[f] = lay->reclen;
+    lay->width[f] = fields[f].width;
+    lay->reclen += fields[f].width;
+    *t++ = htons(fields[f].type);
+    *t++ = htons(fields[f].width);
+    n++;
+  }
+  if (n == 0)
+    fatal("no field to export");
+
+  ((u_int16_t *)(tset + sizeof(*set)))[1] = htons(n);
+  tset_len = (u_int8_t *)t - tset;
+  set->id = htons(nf_version == NF_VERSION_IPFIX ?
+		  IPFIX_TEMPLATE_SET : NF9_TEMPLATE_SET);
+  set->length = htons(tset_len);
+}
+
+/*
+ * Evaluates the static fields once into the record template. Only the
+ * rest is left to gen_flows().
+ */
+void compile_record(struct flow_exporter *ex)
+{
+  int i;
+
+  memcpy(&ex->lay, &layout, sizeof(ex->lay));
+  compile_prof(ex, &ex->base);
+
+  ex->hdr_static = expr_static(&ex->engine_type) &&
+    expr_static(&ex->engine_id) && !ex->nvex;
+  for (i=0; i < ex->batch_size; i++)
+    init_hdr(ex, ex->iov[i].iov_base);
+}
+
+
+/*
+ * Sets up the worker's virtual exporters, numbered from base on. Each
+ * draws its flow rate, engine_type, engine_id and spoofed source
+ * address (spoof may be NULL) once from the expressions, which are
+ * shared by all the workers, and gets its own boot time. A PDU carries
+ * up to bucket_size flows, or a second worth of them at a lower rate.
+ */
+void init_vexporters(struct flow_exporter *ex, u_int32_t base,
+		     val_expr_t *rate, val_expr_t *type, val_expr_t *id,
+		     ipaddr_expr_t *spoof)
+{
+  struct vexporter *vx;
+  u_int32_t i;
+  long r;
+
+  ex->vex = calloc(ex->nvex, sizeof(struct vexporter));
+  ex->wheel = malloc(sizeof(u_int32_t) * WHEEL_SIZE);
+  if (!ex->vex || !ex->wheel)
+    fatal("out of memory");
+  for (i=0; i < WHEEL_SIZE; i++)
+    ex->wheel[i] = VEX_NIL;
+
+  for (i=0; i < ex->nvex; i++) {
+    vx = &ex->vex[i];
+    if ((r = expr_val(rate)) < 1)
+      r = 1;
+    vx->k = r < ex->bucket_size ? r : ex->bucket_size;
+    vx->period = (u_int64_t)vx->k * 1000000000ULL / r;
+    if (warp > 0)
+      vx->period /= warp;	/* rates are of the virtual clock */
+    vx->engine_type = expr_val(type) & 0xff;
+    vx->engine_id = expr_val(id) & 0xff;
+    vx->source_id = ((base + i) << 16) | (vx->engine_type << 8) |
+      vx->engine_id;
+    vx->up_off = rng_range(30 * 86400 * 1000U);	/* up to 30 days ago */
+    if (spoof)
+      vx->src_addr = htonl(expr_addr(spoof));
+  }
+}
+
+static inline void wheel_insert(struct flow_exporter *ex, u_int32_t i)
+{
+  u_int32_t *slot =
+    &ex->wheel[(ex->vex[i].due / WHEEL_TICK) & (WHEEL_SIZE - 1)];
+
+  ex->vex[i].next = *slot;
+  *slot = i;
+}
+
+/*
+ * Runs the virtual exporters: every tick, the ones whose PDUs are due
+ * are taken off the current slot of the wheel, emit into the batch and
+ * go back to the slot of their next PDU, so a tick costs as much as
+ * the PDUs due in it, no matter how many exporters there are. The batch
+ * goes out at the end of the tick.
+ */
+void run_vexporters(struct flow_exporter *ex)
+{
+  struct vexporter *vx;
+  struct timespec ts;
+  u_int64_t t0, tick;
+  u_int32_t i, next;
+  unsigned long n = 0;
+  int k;
+
+  /* spread the first PDUs over the periods */
+  t0 = now_ns();
+  for (i=0; i < ex->nvex; i++) {
+    ex->vex[i].due = t0 + rng_range(ex->vex[i].period);
+    wheel_insert(ex, i);
+  }
+  ex->pc.t0 = t0;
+
+  for (tick = t0 / WHEEL_TICK; !stop_f; tick++) {
+    i = ex->wheel[tick & (WHEEL_SIZE - 1)];
+    ex->wheel[tick & (WHEEL_SIZE - 1)] = VEX_NIL;
+
+    for (; i != VEX_NIL; i = next) {
+      vx = &ex->vex[i];
+      next = vx->next;
+
+      /* more than one PDU a tick at a high rate */
+      do {
+	k = vx->k;
+	if (ex->count && k > ex->count - n)
+	  k = ex->count - n;
+	ex->vx = vx;
+	gen_flows(ex, k);
+	flush_flow(ex);
+	n += k;
+	vx->due += vx->period;
+      } while (vx->due / WHEEL_TICK <= tick &&
+	       (!ex->count || n < ex->count));
+      wheel_insert(ex, i);
+
+      if (ex->count && n >= ex->count)
+	break;
+    }
+    send_batch(ex);
+    if (ex->count && n >= ex->count)
+      break;
+
+    /* sleep till the next tick, unless running behind */
+    ts.tv_sec = (tick + 1) * WHEEL_TICK / 1000000000ULL;
+    ts.tv_nsec = (tick + 1) * WHEEL_TICK % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+}
+
+/*
+ * Flow cache emulation. Flows arrive at fc->rate, each with the key
+ * rendered from the flowrec-options, a duration (firstseen, msec) and
+ * packets and octets spread evenly over it, and stay in the cache
+ * until they are exported as a router would: every active timeout
+ * while they go on, with the packets and octets since the last export,
+ * and for good an inactive timeout after their last packet. A flow
+ * whose key is already in the cache just adds to it.
+ *
+ * The flows are kept in an array of fixed size entries, found by key
+ * through an open addressing index and expired by a timer wheel with
+ * CACHE_TICK slots, so a flow costs its entry and two index slots.
+ */
+static inline struct cflow *cache_flow(struct flow_cache *fc, u_int32_t i)
+{
+  return (struct cflow *)(fc->flows + (size_t)i * fc->stride);
+}
+
+static inline u_int32_t cache_hash(const u_int8_t *key, int len)
+{
+  u_int64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+  while (len-- > 0)
+    h = (h ^ *key++) * 0x100000001b3ULL;
+  return h ^ (h >> 32);
+}
+
+void cache_init(struct flow_exporter *ex, u_int32_t size, double rate,
+		u_int32_t active, u_int32_t inactive)
+{
+  static const int counters[] =
+    { FIELD_PACKETS, FIELD_OCTETS, FIELD_FIRST, FIELD_LAST };
+  struct rec_layout *lay = &ex->lay;
+  struct flow_cache *fc;
+  u_int32_t i, n;
+  int f, end = 0;
+
+  if ((fc = calloc(1, sizeof(*fc))) == NULL)
+    fatal("out of memory");
+  fc->size = size;
+  fc->rate = rate;
+  fc->active = active;
+  fc->inactive = inactive;
+
+  /* the counters and time stamps are next to each other in a record */
+  fc->cut = lay->reclen;
+  for (f=0; f < 4; f++) {
+    if (lay->off[counters[f]] < 0)
+      continue;
+    if (lay->off[counters[f]] < fc->cut)
+      fc->cut = lay->off[counters[f]];
+    if (lay->off[counters[f]] + lay->width[counters[f]] > end)
+      end = lay->off[counters[f]] + lay->width[counters[f]];
+    fc->cutlen += lay->width[counters[f]];
+  }
+  if (fc->cutlen && end - fc->cut != fc->cutlen)
+    fatal("counters are apart in the flow record");
+  fc->keylen = lay->reclen - fc->cutlen;
+  fc->stride = (sizeof(struct cflow) + fc->keylen + 3) & ~3;
+
+  for (n = 2; n < size * 2; n <<= 1)
+    ;
+  fc->mask = n - 1;
+  for (n = 2; n < (active > inactive ? active : inactive) / CACHE_TICK + 2;
+       n <<= 1)
+    ;
+  fc->wmask = n - 1;
+
+  fc->flows = malloc(fc->stride * size);
+  fc->index = malloc(sizeof(u_int32_t) * (fc->mask + 1));
+  fc->wheel = malloc(sizeof(u_int32_t) * (fc->wmask + 1));
+  fc->scratch = malloc(lay->reclen * COL_MAX);
+  if (!fc->flows || !fc->index || !fc->wheel || !fc->scratch)
+    fatal("out of memory");
+  memset(fc->index, 0xff, sizeof(u_int32_t) * (fc->mask + 1));
+  memset(fc->wheel, 0xff, sizeof(u_int32_t) * (fc->wmask + 1));
+
+  for (i=0; i < size; i++)
+    cache_flow(fc, i)->next = i + 1 < size ? i + 1 : CACHE_NIL;
+  fc->free = 0;
+
+  ex->fc = fc;
+}
+
+/* puts a flow on the wheel, in the slot of its next timeout */
+static void cache_schedule(struct flow_cache *fc, u_int32_t i)
+{
+  struct cflow *cf = cache_flow(fc, i);
+  u_int32_t due, *slot;
+
+  due = cf->exp + fc->active;
+  if (cf->end + fc->inactive < due)
+    due = cf->end + fc->inactive;
+  if (due < fc->now + CACHE_TICK)
+    due = fc->now + CACHE_TICK;	/* the tick at hand is over */
+  slot = &fc->wheel[(due / CACHE_TICK) & fc->wmask];
+  cf->next = *slot;
+  *slot = i;
+}
+
+/* a new flow, from a rendered record */
+static void cache_arrive(struct flow_exporter *ex, const u_int8_t *rec,
+			 u_int32_t dur)
+{
+  struct flow_cache *fc = ex->fc;
+  struct rec_layout *lay = &ex->lay;
+  u_int8_t key[MAX_RECLEN];
+  u_int32_t pkts = 1, octs = 0, i, j;
+  struct cflow *cf;
+
+  if (lay->off[FIELD_PACKETS] >= 0)
+    pkts = get_field(rec + lay->off[FIELD_PACKETS], lay->width[FIELD_PACKETS]);
+  if (lay->off[FIELD_OCTETS] >= 0)
+    octs = get_field(rec + lay->off[FIELD_OCTETS], lay->width[FIELD_OCTETS]);
+  if (pkts == 0)
+    pkts = 1;
+
+  memcpy(key, rec, fc->cut);
+  memcpy(key + fc->cut, rec + fc->cut + fc->cutlen, fc->keylen - fc->cut);
+
+  for (j = cache_hash(key, fc->keylen) & fc->mask; fc->index[j] != CACHE_NIL;
+       j = (j + 1) & fc->mask) {
+    cf = cache_flow(fc, fc->index[j]);
+    if (memcmp(key, cf + 1, fc->keylen) == 0) {
+      cf->pkts += pkts;
+      cf->octs += octs;
+      if (fc->now + dur > cf->end)
+	cf->end = fc->now + dur;	/* rescheduled when its timer fires */
+      return;
+    }
+  }
+
+  if ((i = fc->free) == CACHE_NIL) {
+    fc->drops++;
+    return;
+  }
+  cf = cache_flow(fc, i);
+  fc->free = cf->next;
+  cf->exp = fc->now;
+  cf->end = fc->now + dur;
+  cf->pkts = pkts;
+  cf->octs = octs;
+  memcpy(cf + 1, key, fc->keylen);
+  fc->index[j] = i;
+  fc->nflows++;
+  cache_schedule(fc, i);
+}
+
+/*
+ * Takes a flow out of the index, moving back the ones after it which
+ * would not be found any more, and frees it.
+ */
+static void cache_remove(struct flow_cache *fc, u_int32_t i)
+{
+  struct cflow *cf = cache_flow(fc, i);
+  u_int32_t j, k, home;
+
+  for (j = cache_hash((u_int8_t *)(cf + 1), fc->keylen) & fc->mask;
+       fc->index[j] != i; j = (j + 1) & fc->mask)
+    ;
+  for (k = (j + 1) & fc->mask; fc->index[k] != CACHE_NIL;
+       k = (k + 1) & fc->mask) {
+    home = cache_hash((u_int8_t *)(cache_flow(fc, fc->index[k]) + 1),
+		      fc->keylen) & fc->mask;
+    if (((k - home) & fc->mask) >= ((k - j) & fc->mask)) {
+      fc->index[j] = fc->index[k];
+      j = k;
+    }
+  }
+  fc->index[j] = CACHE_NIL;
+
+  cf->next = fc->free;
+  fc->free = i;
+  fc->nflows--;
+}
+
+/* a record of the flow from cf->exp till t */
+static void cache_export(struct flow_exporter *ex, struct cflow *cf,
+			 u_int32_t t, u_int32_t pkts, u_int32_t octs)
+{
+  struct flow_cache *fc = ex->fc;
+  struct rec_layout *lay = &ex->lay;
+  u_int8_t *rec, *key = (u_int8_t *)(cf + 1);
+
+  if (ex->flow_cnt == 0) {
+    begin_pdu(ex);
+    fc->pdu_start = fc->now;
+  }
+  rec = (u_int8_t *)ex->iov[ex->batch_cnt].iov_base +
+    ex->rec_off + ex->flow_cnt * lay->reclen;
+
+  memcpy(rec, key, fc->cut);
+  memcpy(rec + fc->cut + fc->cutlen, key + fc->cut, fc->keylen - fc->cut);
+  if (lay->off[FIELD_PACKETS] >= 0)
+    put_field(rec + lay->off[FIELD_PACKETS], lay->width[FIELD_PACKETS], pkts);
+  if (lay->off[FIELD_OCTETS] >= 0)
+    put_field(rec + lay->off[FIELD_OCTETS], lay->width[FIELD_OCTETS], octs);
+  if (lay->off[FIELD_FIRST] >= 0)
+    put_field(rec + lay->off[FIELD_FIRST], lay->width[FIELD_FIRST],
+	      fc->up0 + cf->exp);
+  if (lay->off[FIELD_LAST] >= 0)
+    put_field(rec + lay->off[FIELD_LAST], lay->width[FIELD_LAST],
+	      fc->up0 + t);
+
+  ex->flow_seen++;
+  if (++ex->flow_cnt == ex->bucket_size)
+    flush_flow(ex);
+}
+
+/*
+ * Fires the timers of a flow: exports what it has had since the last
+ * export, and either removes it or puts it back on the wheel.
+ */
+static void cache_expire(struct flow_exporter *ex, u_int32_t i)
+{
+  struct flow_cache *fc = ex->fc;
+  struct cflow *cf = cache_flow(fc, i);
+  u_int32_t t, pkts, octs;
+
+  if (fc->now < cf->exp + fc->active && fc->now < cf->end + fc->inactive) {
+    cache_schedule(fc, i);	/* it was extended in the meantime */
+    return;
+  }
+
+  /* all of it after its last packet, or the share of the time so far */
+  t = fc->now < cf->end ? fc->now : cf->end;
+  pkts = cf->pkts;
+  octs = cf->octs;
+  if (t < cf->end) {
+    pkts = (u_int64_t)cf->pkts * (t - cf->exp) / (cf->end - cf->exp);
+    octs = (u_int64_t)cf->octs * pkts / cf->pkts;
+  }
+  if (pkts)
+    cache_export(ex, cf, t, pkts, octs);
+  cf->pkts -= pkts;
+  cf->octs -= octs;
+  cf->exp = t;
+
+  if (t == cf->end)
+    cache_remove(fc, i);
+  else
+    cache_schedule(fc, i);
+}
+
+/*
+ * Runs the flow cache: every tick, the flows born in it are added and
+ * the ones whose timeouts are in it are expired. The cache time is
+ * that of the clock read at the tick, so no record is stamped later
+ * than its PDU; ticks missed while running behind are caught up. A PDU
+ * goes out when it is full, or a second after it was started.
+ */
+void run_cache(struct flow_exporter *ex)
+{
+  struct flow_cache *fc = ex->fc;
+  struct timespec ts;
+  u_int64_t clk0, tick, born;
+  u_int32_t i, next, now, t = 0, dur[COL_MAX];
+  u_int8_t *rec;
+  int k, j;
+
+  clk0 = ex->clk = clock_ns();
+  fc->up0 = clock_uptime(clk0);
+  ex->pc.t0 = now_ns();
+
+  for (tick = ex->pc.t0 / (CACHE_TICK * 1000000ULL); !stop_f; tick++) {
+    ex->clk = clock_ns();
+    now = (ex->clk - clk0) / 1000000;
 
-  /* str = "<val_expr>.<val_expr>.<val_expr>.<val_expr>" */
+    for (; t <= now; t += CACHE_TICK) {
+      fc->now = t;
+      born = (u_int64_t)(fc->rate * t / 1000);
+      while (fc->born < born) {
+	k = born - fc->born < COL_MAX ? born - fc->born : COL_MAX;
+	render_records(ex, fc->scratch, k, dur, NULL);
+	for (j=0, rec = fc->scratch; j < k; j++, rec += ex->lay.reclen)
+	  cache_arrive(ex, rec, dur[j]);
+	fc->born += k;
+      }
 
-  for (i=0; i<4; i++) {
-    memset(buf, 0, sizeof(buf));
-    while (1) {
-      if (*p == '.' || *p == '\0') {
-	if (p - str >= sizeof(buf) - 1)
-	  fatal("out of range");
-	strncpy(buf, str, p - str);
-	compile_expr(buf, &octet);
-	memcpy(&(ie->exp[i]), &octet, sizeof(val_expr_t));
-	if (*p)
-	  str = ++p;
-	break;
-      } else {
-	p++;
-	continue;
+      i = fc->wheel[(t / CACHE_TICK) & fc->wmask];
+      fc->wheel[(t / CACHE_TICK) & fc->wmask] = CACHE_NIL;
+      for (; i != CACHE_NIL; i = next) {
+	next = cache_flow(fc, i)->next;
+	cache_expire(ex, i);
       }
     }
+
+    if (ex->flow_cnt && fc->now - fc->pdu_start >= 1000)
+      flush_flow(ex);
+    send_batch(ex);
+    if (ex->count && (unsigned long)ex->flow_seen >= ex->count)
+      break;
+
+    /* sleep till the next tick, unless running behind */
+    ts.tv_sec = (tick + 1) * CACHE_TICK / 1000;
+    ts.tv_nsec = (tick + 1) * CACHE_TICK % 1000 * 1000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
   }
-}
 
+  flush_flow(ex);
+  send_batch(ex);
+  if (debug)
+    fprintf(stderr, "worker %d: %u flows in the cache\n", ex->id, fc->nflows);
+}
 
-long expr_val(val_expr_t *e)
+/*
+ * Generates ex->count flows (or until interrupted) from the worker's
+ * own copy of the expressions.
+ */
+void generate(struct flow_exporter *ex)
 {
-  long val = e->cur;
+  struct flow_exprs *fx = &ex->base.fx;
+  unsigned long n = 0;
+  int k;
 
-  switch (e->mode) {
-  case EXPR_TYPE_SEQ:
-    e->cur += e->step;
-    if (e->cur > e->end)
-      e->cur = e->start;
-    return val;
-  case EXPR_TYPE_RND:
-    e->cur =
-      (long)(random()/(double)RAND_MAX * (e->end - e->start) + e->start);
-    if (e->cur < e->start || e->cur > e->end)
-      fatal("unexpected random number");
-    return e->cur;
-  case EXPR_TYPE_PRB:
-    e->cur = e->vals[(int)(random()/(double)RAND_MAX * (100-1))];
-    return e->cur;
-  default:
-    fatal("unknown expr mode");
-  }
-  return 0L;	/* should not reach here */
-}
+  while (!stop_f) {
+    /*
+     * Fill the rest of the PDU at once, unless a wait has to be placed
+     * between flows.
+     */
+    k = ex->bucket_size - ex->flow_cnt;
+    if (ex->wait_f && ex->pc.rate == 0)
+      k = 1;
+    if (ex->count && k > ex->count - n)
+      k = ex->count - n;
 
+    gen_flows(ex, k);
+    if (ex->flow_cnt == ex->bucket_size)
+      flush_flow(ex);
 
-void expr_addr(char *ipaddr, ipaddr_expr_t *ie)
-{
-  int octet[4];
-  int i;
+    if (ex->wait_f && ex->pc.rate == 0) {
+      struct timespec req;
+      unsigned long w;
 
-  for (i=0; i<4; i++) {
-    octet[i] = expr_val(&(ie->exp[i]));
-    if (octet[i] < 0 || octet[i] > 255) {
-      fatal("ipaddr_expr error");
+      if ((n % expr_val(&fx->intvl)) == 0) {
+	w = (unsigned long)expr_val(&fx->wait) * ex->wait_scale;
+	req.tv_sec = (w * 1000 * 1000) / 1000000000;
+	req.tv_nsec = (w * 1000 * 1000) % 1000000000;
+	if (nanosleep(&req, NULL) == -1 && errno != EINTR)
+	  perror("nanosleep");
+      }
     }
+
+    n += k;
+    if (!ex->count)
+      continue;
+    else if (n >= ex->count)
+      break;
   }
-  sprintf(ipaddr, "%d.%d.%d.%d", octet[0], octet[1], octet[2], octet[3]);
 
+  flush_flow(ex);
+  send_batch(ex);
 }
 
+
 /*
- * Returns sysuptime in millisecond
- *
- */
-#if 0
-/*
- * XXX: this version is highly inefficient!
+ * Main loop of a worker.
  */
-u_int32_t sysuptime(void)
+void *run_exporter(void *arg)
 {
-  double uptime, dummy;
-  FILE *fp;
+  struct flow_exporter *ex = arg;
+  struct timespec ts;
 
-  fp = fopen("/proc/uptime", "r");
-  fscanf(fp, "%lf %lf", &uptime, &dummy);
-  fclose(fp);
+  rng_init(rng_seed, ex->id);
+  vrng_init();
 
-  return ((u_int32_t)(uptime * 1000.0));
-}
+#if defined (__linux__)
+  if (ex->cpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(ex->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      fprintf(stderr, "worker %d: cannot pin to cpu %d\n", ex->id, ex->cpu);
+  }
+#endif
+
+  if (ex->pool_size) {
+    prerender(ex);
+    ex->pc.t0 = now_ns();
+    replay_pool(ex);
+  } else if (ex->pin) {
+    ex->pc.t0 = now_ns();
+    replay_pcap(ex);
+  } else if (ex->nvex)
+    run_vexporters(ex);
+  else if (ex->fc)
+    run_cache(ex);
+  else {
+    ex->pc.t0 = now_ns();
+    generate(ex);
+  }
+
+  if (ex->pcap_fd >= 0)
+    pcap_close(ex);
+#if defined (__linux__)
+  if (ex->ring_fd >= 0)
+    ring_close(ex);
+  if (ex->ur)
+    uring_close(ex);
 #endif
 
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  ex->cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  __atomic_store_n(&ex->done_f, TRUE, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+
 /*
- * Returns sysuptime (in millisecond)
- *
+ * Benchmarks of the building blocks and of the whole pipeline, run in
+ * the main thread with the options given and worker 0's exporter. Each
+ * one is repeated with twice as many operations until it takes at least
+ * BENCH_NS, so that the clock and the warm-up do not count much.
  */
-#if defined (__linux__)
-u_int32_t sysuptime(void)
-{
-  static int initialized = 0;
-  static double uptime;
-  double dummy;
-  static struct timeval init_tv;
-  struct timeval tv;
+#define BENCH_NS	200000000ULL
 
-  FILE *fp;
+struct bench {
+  const char *name;
+  const char *str;	/* expression to compile */
+  val_expr_t e;
+  ipaddr_expr_t ie;
+  struct flow_exporter *ex;
+  long pdus;		/* # of PDUs sent in the last run */
+};
 
-  if (!initialized) {
-    fp = fopen("/proc/uptime", "r");
-    fscanf(fp, "%lf %lf", &uptime, &dummy);
-    fclose(fp);
-    uptime *= 1000.0;	/* in milisec */
-    gettimeofday(&init_tv, (struct timezone *)0);
-    initialized = 1;
-    return ((u_int32_t)uptime);
-  } else {
-    gettimeofday(&tv, (struct timezone *)0);
-    return ((u_int32_t)(uptime +
-			tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0 -
-			init_tv.tv_sec * 1000.0 + init_tv.tv_usec / 1000.0));
-  }
-}
-#endif
+volatile u_int64_t bench_sink;	/* so that results are not optimized out */
 
-#if defined (__FreeBSD__) || defined (__APPLE__)
-#include <sys/sysctl.h>
-u_int32_t sysuptime(void)
+static void bench_compile(struct bench *b, long n)
 {
-  time_t now, uptime = 0;
-  struct timeval boottime;
-  int mib[2];
-  size_t size;
+  val_expr_t e;
 
-  mib[0] = CTL_KERN;
-  mib[1] = KERN_BOOTTIME;
-  size = sizeof(boottime);
-  if (sysctl(mib, 2, &boottime, &size, NULL, 0) != -1) {
-    time(&now);
-    uptime = now - boottime.tv_sec;
+  for (; n > 0; n--) {
+    memset(&e, 0, sizeof(e));
+    compile_expr(b->str, &e);
+    free_expr(&e);
   }
-  return uptime * 1000;		/* returns in millisec */
 }
-#endif
 
-void flush_flow(void)
+static void bench_val(struct bench *b, long n)
 {
-  struct timeval tv;
-  struct nf_v5_pdu pdu;
-  int i;
-
-  gettimeofday(&tv, (struct timezone *)0);
+  u_int64_t sum = 0;
 
-  pdu.hdr.version = htons(NF_VERSION_V5);
-  pdu.hdr.count = htons(Ex.flow_cnt);
-  pdu.hdr.sysup_time = htonl(sysuptime());
-  pdu.hdr.unix_secs = htonl(tv.tv_sec);
-  pdu.hdr.unix_nsecs = htonl(tv.tv_usec * 1000);
-  pdu.hdr.flow_sequence = htonl(Ex.flow_seen);
-  pdu.hdr.engine_type = expr_val(&Ex.engine_type) & 0xff;
-  pdu.hdr.engine_id = expr_val(&Ex.engine_id) & 0xff;
-  pdu.hdr.sampling = htons(0);
+  for (; n > 0; n--)
+    sum += expr_val(&b->e);
+  bench_sink += sum;
+}
 
-  memset(&pdu.rec[0], 0, sizeof(struct nf_v5_rec) * NF5_MAX_FLOWREC);
+static void bench_fill(struct bench *b, long n)
+{
+  u_int32_t col[COL_MAX];
+  int k;
 
-  for (i=0; i < Ex.flow_cnt; i++) {
-    memcpy(&pdu.rec[i].src_addr, &Ex.fi[i].src_addr, sizeof(struct in_addr));
-    memcpy(&pdu.rec[i].dst_addr, &Ex.fi[i].dst_addr, sizeof(struct in_addr));
-    memcpy(&pdu.rec[i].nexthop, &Ex.fi[i].nexthop, sizeof(struct in_addr));
-    pdu.rec[i].in_if = htons(Ex.fi[i].in_if);
-    pdu.rec[i].out_if = htons(Ex.fi[i].out_if);
-    pdu.rec[i].packets = htonl(Ex.fi[i].packets);
-    pdu.rec[i].octets = htonl(Ex.fi[i].octets);
-    pdu.rec[i].first = htonl(Ex.fi[i].first);
-    pdu.rec[i].last = htonl(Ex.fi[i].last);
-    pdu.rec[i].src_port = htons(Ex.fi[i].src_port);
-    pdu.rec[i].dst_port = htons(Ex.fi[i].dst_port);
-    pdu.rec[i].tcp_flags = Ex.fi[i].tcp_flags;
-    pdu.rec[i].ip_proto = Ex.fi[i].ip_proto;
-    pdu.rec[i].tos = Ex.fi[i].tos;
-    pdu.rec[i].src_as = htons(Ex.fi[i].src_as);
-    pdu.rec[i].dst_as = htons(Ex.fi[i].dst_as);
-    pdu.rec[i].src_mask = Ex.fi[i].src_mask;
-    pdu.rec[i].dst_mask = Ex.fi[i].dst_mask;
+  for (; n > 0; n -= k) {
+    k = n < COL_MAX ? n : COL_MAX;
+    expr_fill(&b->e, col, k);
+    bench_sink += col[k - 1];
   }
+}
 
-  if (!nosend_f)
-    if (sendto(Ex.sock, &pdu,
-	       sizeof(struct nf_v5_hdr) +
-	       sizeof(struct nf_v5_rec) * Ex.flow_cnt, 0,
-	       (struct sockaddr *)&Ex.to, sizeof(Ex.to)) == -1)
-      perror("sendto");
-
+static void bench_addr(struct bench *b, long n)
+{
+  u_int64_t sum = 0;
 
-  Ex.pdu_sent++;
-  Ex.flow_cnt = 0;
+  for (; n > 0; n--)
+    sum += expr_addr(&b->ie);
+  bench_sink += sum;
 }
 
-void add_flow(struct flow_info *fi)
+static void bench_addr_fill(struct bench *b, long n)
 {
-  if (Ex.flow_cnt < Ex.bucket_size) {
-    memcpy(&Ex.fi[Ex.flow_cnt++], fi, sizeof(struct flow_info));
-    Ex.flow_seen++;
-  }
-  if (Ex.flow_cnt == Ex.bucket_size) {
-    flush_flow();
+  u_int32_t col[COL_MAX];
+  int k;
+
+  for (; n > 0; n -= k) {
+    k = n < COL_MAX ? n : COL_MAX;
+    expr_addr_fill(&b->ie, col, k);
+    bench_sink += col[k - 1];
   }
 }
 
-void cleanup(int val)
+/* gen_flows() and flush_flow() alone, the batch is never sent */
+static void bench_encode(struct bench *b, long n)
 {
-  struct timeval now;
+  struct flow_exporter *ex = b->ex;
+  long pdus = ex->pdu_sent;
+  int k;
 
-  flush_flow();
-  fprintf(stderr, "\n%lu flows seen, %lu PDUs sent ",
-	  Ex.flow_seen, Ex.pdu_sent);
+  for (; n > 0; n -= k) {
+    k = ex->bucket_size - ex->flow_cnt;
+    if (k > n)
+      k = n;
+    gen_flows(ex, k);
+    if (ex->flow_cnt == ex->bucket_size)
+      flush_flow(ex);
+  }
+  b->pdus = ex->pdu_sent - pdus;
+}
 
-  /* XXX: only care about sec, not usec */
-  gettimeofday(&now, (struct timezone *)0);
-  fprintf(stderr, "(session rate = %lu/sec)\n",
-	  Ex.flow_seen / (now.tv_sec - Ex.start.tv_sec));
+/* a whole run of the worker, on a copy of its state */
+static void bench_pipeline(struct bench *b, long n)
+{
+  struct flow_exporter ex;
 
-  exit(0);
+  memcpy(&ex, b->ex, sizeof(ex));
+  ex.count = n;
+  ex.flow_seen = ex.pdu_sent = 0;
+  ex.flow_cnt = ex.batch_cnt = ex.batch_flows = 0;
+  ex.pc.rate = 0;
+  run_exporter(&ex);
+  b->pdus = ex.pdu_sent;
 }
 
-
-void init_exporter(const char *dst, u_int16_t port, u_int32_t flowrec_count)
+void bench_run(FILE *fp, struct bench *b, const char *unit,
+	       void (*fn)(struct bench *, long))
 {
-  struct sigaction sigact;
+  u_int64_t t0, t;
+  double ns;
+  long n;
 
-  gettimeofday(&Ex.start, (struct timezone *)0);
+  for (n = 1000; ; n *= 2) {
+    b->pdus = 0;
+    t0 = now_ns();
+    fn(b, n);
+    t = now_ns() - t0;
+    if (t >= BENCH_NS || stop_f)
+      break;
+  }
+  ns = (double)t / n;
 
-  /* XXX: assumes dst is in XXX.XXX.XXX.XXX format */
-  inet_aton(dst, &Ex.collector);
+  printf("%-20s %10.2f ns/%-5s %12.0f %s/s", b->name, ns, unit, 1e9 / ns,
+	 unit);
+  if (b->pdus)
+    printf(" %10.0f PDUs/s", b->pdus * 1e9 / t);
+  printf("\n");
+  fprintf(fp, "%s\t%s\t%.2f\t%.0f\t%.0f\n", b->name, unit, ns, 1e9 / ns,
+	  b->pdus * 1e9 / t);
+}
 
-  Ex.port = port;
+void bench(const char *file)
+{
+  static const struct {
+    const char *name;
+    const char *str;
+  } exprs[] = {
+    { "static",	"100" },
+    { "seq",	"1-1000" },
+    { "seq-step", "1-1000/3" },
+    { "rnd",	"1:1000" },
+    { "prb",	"100@70,200@20,300@10" },
+    { "zipf",	"zipf(1000,1.2)" },
+    { "pareto",	"pareto(300,1.5)" },
+    { "lognormal", "lognormal(8,1.5)" },
+  }, addrs[] = {
+    { "octet",	"10.0.0.1:254" },
+    { "seq",	"10.0.0.0/8" },
+    { "rnd",	":10.0.0.0/8" },
+    { "zipf",	"zipf(10.0.0.0/16,1.2)" },
+  };
+  struct flow_exporter *ex = &Ex[0];
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  struct bench b;
+  char name[64];
+  FILE *fp;
+  int sink, bufsize = 4 * 1024 * 1024;
+  size_t i;
 
-  if ((Ex.sock = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
-    perror("socket");
+  if ((fp = fopen(file, "w")) == NULL) {
+    perror(file);
     exit(1);
   }
+  fprintf(fp, "# flowgen bench: version %d, flowrec %d, batch %d%s, "
+	  "simd %s\n", nf_version, ex->bucket_size, ex->batch_size,
+	  ex->gso_f ? " (gso)" : "", simd.name);
+  fprintf(fp, "name\tunit\tns\tops_per_sec\tpdus_per_sec\n");
 
-  memset(&Ex.to, 0, sizeof(Ex.to));
-  Ex.to.sin_family = AF_INET;
-  Ex.to.sin_port = htons(port);
-  memcpy(&Ex.to.sin_addr, &Ex.collector, sizeof(Ex.collector));
+  rng_init(rng_seed, 0);
+  vrng_init();
+  memset(&b, 0, sizeof(b));
+  b.ex = ex;
 
-  Ex.flow_seen = 0L;
-  Ex.pdu_sent = 0L;
-  Ex.flow_cnt = 0;
-  Ex.bucket_size = flowrec_count;
+  for (i=0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+    b.str = exprs[i].str;
+    snprintf(name, sizeof(name), "compile-%s", exprs[i].name);
+    b.name = name;
+    bench_run(fp, &b, "op", bench_compile);
 
-  memset(Ex.fi, 0, sizeof(struct flow_info) * MAX_FLOW_INFO);
+    memset(&b.e, 0, sizeof(b.e));
+    compile_expr(b.str, &b.e);
+    snprintf(name, sizeof(name), "val-%s", exprs[i].name);
+    bench_run(fp, &b, "op", bench_val);
+    snprintf(name, sizeof(name), "fill-%s", exprs[i].name);
+    bench_run(fp, &b, "op", bench_fill);
+    free_expr(&b.e);
+  }
 
-  srandom((unsigned int)time(NULL));	/* XXX */
+  for (i=0; i < sizeof(addrs) / sizeof(addrs[0]); i++) {
+    compile_ipaddr_expr(addrs[i].str, &b.ie);
+    snprintf(name, sizeof(name), "addr-%s", addrs[i].name);
+    b.name = name;
+    bench_run(fp, &b, "op", bench_addr);
+    snprintf(name, sizeof(name), "addr-fill-%s", addrs[i].name);
+    bench_run(fp, &b, "op", bench_addr_fill);
+  }
 
-  memset(&sigact, 0, sizeof(sigact));
-  sigact.sa_handler = cleanup;
+  nosend_f = TRUE;
+  b.name = "encode";
+  bench_run(fp, &b, "flow", bench_encode);
+  ex->flow_cnt = ex->batch_cnt = ex->batch_flows = 0;
 
-  sigaction(SIGINT, &sigact, NULL);
+  b.name = "pipeline-nosend";
+  bench_run(fp, &b, "flow", bench_pipeline);
+
+  /* a socket nobody reads, so that datagrams are not answered by ICMP */
+  if ((sink = socket(PF_INET, SOCK_DGRAM, 0)) == -1) {
+    perror("socket");
+    exit(1);
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  if (bind(sink, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+      getsockname(sink, (struct sockaddr *)&sin, &len) == -1) {
+    perror("bind");
+    exit(1);
+  }
+  memcpy(&ex->to, &sin, sizeof(sin));
 
+  nosend_f = FALSE;
+  b.name = "pipeline-loopback";
+  bench_run(fp, &b, "flow", bench_pipeline);
+
+  close(sink);
+  fclose(fp);
 }
 
 
@@ -459,7 +5191,10 @@ int main(int argc, char **argv)
   u_int16_t port = 2055;
   char *wait = "0";
   char *interval = "1";
-  u_int32_t flowrec_count = NF5_MAX_FLOWREC;
+  u_int32_t flowrec_count = 0;	/* 0 = as many as fit */
+  u_int32_t max_flowrec;
+  int batch_size = 1;
+  int gso_f = TRUE;
   char *engine_type = "1";
   char *engine_id = "1";
   char *src_addr = "10.0.0.1:254";
@@ -471,7 +5206,6 @@ int main(int argc, char **argv)
   char *octets = "300:300000";
   char *first = "10:1000";
   char *last = "0";	/* 0 = now */
-  u_int32_t ut;
   char *src_port = "1001-2000";
   char *dst_port = "3001-4000";
   char *tcp_flags = "27";
@@ -481,16 +5215,50 @@ int main(int argc, char **argv)
   char *dst_as = "201-210";
   char *src_mask = "24";
   char *dst_mask = "24";
-  val_expr_t
-    wait_exp, intvl_exp, iif_exp, oif_exp, pkt_exp, oct_exp,
-    fseen_exp, lseen_exp, srcp_exp, dstp_exp, tcpf_exp,
-    proto_exp, tos_exp, srcas_exp, dstas_exp, srcmask_exp, dstmask_exp;
-  ipaddr_expr_t
-    srcaddr_exp, dstaddr_exp, nhop_exp;
-  struct flow_info fi;
-  long n = 0;
+  char *cpu = NULL;
+  struct pacer pc;
+  char *rate_prof_spec = NULL;
+  static struct rate_prof rate_prof;
+  struct flow_exprs fx;
+  val_expr_t engine_type_exp, engine_id_exp, cpu_exp;
+  struct sigaction sigact;
+  sigset_t sigs;
   int wait_f = FALSE;
-  int c;
+  int nosimd_f = FALSE;
+  int coarse_clock_f = FALSE;
+  double time_warp = 0;
+  char *start_time = NULL;
+  u_int64_t start_ns = 0;
+  long pool_size = 0;
+  char *pcap_out = NULL;
+  char *pcap_in = NULL;
+  static struct pcap_in pin;
+  char *field_list = NULL;
+  char *packet_if = NULL;
+  char *dst_mac = NULL;
+  int qdisc_bypass_f = FALSE;
+  int uring_f = FALSE;
+  char *bench_out = NULL;
+  char *sweep = NULL;
+  char *sweep_out = NULL;
+  double sweep_step = 2;
+  double sweep_hold = 5;
+  int listen_f = FALSE;
+  double stats_ivl = 0;
+  ipaddr_expr_t spoof_exp;
+  u_int32_t nvex = 0, vex_base = 0;
+  char *vex_rate = "100";
+  u_int32_t cache_size = 0;
+  double new_flows = 1000;
+  u_int32_t active_to = 1800, inactive_to = 15;
+  val_expr_t vex_rate_exp;
+  char *tmpl_refresh = "20";
+  char *p;
+  int c, i;
+
+  memset(&pc, 0, sizeof(pc));
+  pin.speed = 1;
+  rng_seed = ((u_int64_t)time(NULL) << 16) ^ getpid();
 
   while (1) {
     int option_index = 0;
@@ -504,9 +5272,49 @@ int main(int argc, char **argv)
       {"count",		required_argument, NULL, 'n'},
       {"spoof",		required_argument, NULL, 's'},
       {"port",		required_argument, NULL, 'p'},
+      {"version",	required_argument, NULL, 'V'},
+      {"fields",	required_argument, NULL, OPT_FIELDS},
+      {"template-refresh", required_argument, NULL, OPT_TMPLREFRESH},
+      {"mtu",		required_argument, NULL, OPT_MTU},
+      {"tcp",		no_argument,       NULL, OPT_TCP},
       {"wait",		required_argument, NULL, 'w'},
       {"interval", 	required_argument, NULL, 'i'},
       {"flowrec",       required_argument, NULL, 'f'},
+      {"batch",		required_argument, NULL, 'b'},
+      {"rate",		required_argument, NULL, 'r'},
+      {"rate-profile",	required_argument, NULL, OPT_RATEPROF},
+      {"spin",		required_argument, NULL, OPT_SPIN},
+      {"threads",	required_argument, NULL, 'T'},
+      {"seed",		required_argument, NULL, 'S'},
+      {"nosimd",	no_argument,       NULL, OPT_NOSIMD},
+      {"pool",		required_argument, NULL, OPT_POOL},
+      {"pcap-out",	required_argument, NULL, OPT_PCAPOUT},
+      {"pcap-in",	required_argument, NULL, OPT_PCAPIN},
+      {"pcap-speed",	required_argument, NULL, OPT_PCAPSPEED},
+      {"packet",	required_argument, NULL, OPT_PACKET},
+      {"qdisc-bypass",	no_argument,       NULL, OPT_QDISCBYPASS},
+      {"dst-mac",	required_argument, NULL, OPT_DSTMAC},
+      {"exporters",	required_argument, NULL, OPT_EXPORTERS},
+      {"exporter-rate",	required_argument, NULL, OPT_EXPRATE},
+      {"flow-cache",	required_argument, NULL, OPT_FLOWCACHE},
+      {"new-flows",	required_argument, NULL, OPT_NEWFLOWS},
+      {"active-timeout", required_argument, NULL, OPT_ACTIVE},
+      {"inactive-timeout", required_argument, NULL, OPT_INACTIVE},
+      {"scenario",	required_argument, NULL, OPT_SCENARIO},
+      {"listen",	no_argument,       NULL, OPT_LISTEN},
+      {"cpu",		required_argument, NULL, OPT_CPU},
+      {"nogso",		no_argument,       NULL, OPT_NOGSO},
+      {"coarse-clock",	no_argument,       NULL, OPT_COARSECLOCK},
+      {"time-warp",	required_argument, NULL, OPT_TIMEWARP},
+      {"start-time",	required_argument, NULL, OPT_STARTTIME},
+      {"uring",		no_argument,       NULL, OPT_URING},
+      {"bench",		required_argument, NULL, OPT_BENCH},
+      {"sweep",		required_argument, NULL, OPT_SWEEP},
+      {"sweep-step",	required_argument, NULL, OPT_SWEEPSTEP},
+      {"sweep-hold",	required_argument, NULL, OPT_SWEEPHOLD},
+      {"sweep-out",	required_argument, NULL, OPT_SWEEPOUT},
+      {"stats",		required_argument, NULL, OPT_STATS},
+      {"json",		no_argument,       NULL, OPT_JSON},
       {"debug",    	required_argument, NULL, 'd'},
       {"nosend",   	no_argument,       NULL, 'N'},
       {"help",     	no_argument,       NULL, 'h'},
@@ -533,7 +5341,7 @@ int main(int argc, char **argv)
       {NULL, 0, NULL, 0}
     };
 
-    c = getopt_long(argc, argv, "n:s:p:w:i:f:d:Nh",
+    c = getopt_long(argc, argv, "n:s:p:V:w:i:f:b:r:T:S:d:Nh",
 		    long_options, &option_index);
     if (c == -1)
       break;
@@ -551,6 +5359,26 @@ int main(int argc, char **argv)
       port = atoi(optarg);
       break;
 
+    case 'V':
+      nf_version = atoi(optarg);
+      break;
+
+    case OPT_FIELDS:
+      field_list = optarg;
+      break;
+
+    case OPT_TMPLREFRESH:
+      tmpl_refresh = optarg;
+      break;
+
+    case OPT_MTU:
+      mtu = atoi(optarg);
+      break;
+
+    case OPT_TCP:
+      tcp_f = TRUE;
+      break;
+
     case 'w':
       wait = optarg;
       wait_f = TRUE;
@@ -564,6 +5392,157 @@ int main(int argc, char **argv)
       flowrec_count = atoi(optarg);
       break;
 
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+
+    case OPT_NOGSO:
+      gso_f = FALSE;
+      break;
+
+    case OPT_COARSECLOCK:
+      coarse_clock_f = TRUE;
+      break;
+
+    case OPT_TIMEWARP:
+      time_warp = atof(optarg);
+      if (time_warp <= 0)
+	fatal("time-warp must be positive");
+      break;
+
+    case OPT_STARTTIME:
+      start_time = optarg;
+      start_ns = parse_time(start_time);
+      break;
+
+    case 'r':
+      parse_rate(optarg, &pc);
+      break;
+
+    case OPT_RATEPROF:
+      rate_prof_spec = optarg;
+      break;
+
+    case OPT_SPIN:
+      pc.spin_ns = (u_int64_t)atol(optarg) * 1000;
+      break;
+
+    case 'T':
+      nworkers = atoi(optarg);
+      break;
+
+    case OPT_CPU:
+      cpu = optarg;
+      break;
+
+    case 'S':
+      rng_seed = strtoull(optarg, NULL, 0);
+      break;
+
+    case OPT_NOSIMD:
+      nosimd_f = TRUE;
+      break;
+
+    case OPT_POOL:
+      pool_size = atol(optarg);
+      break;
+
+    case OPT_PCAPOUT:
+      pcap_out = optarg;
+      break;
+
+    case OPT_PCAPIN:
+      pcap_in = optarg;
+      break;
+
+    case OPT_PCAPSPEED:
+      pin.speed = atof(optarg);
+      if (pin.speed < 0)
+	fatal("pcap-speed must not be negative");
+      break;
+
+    case OPT_URING:
+      uring_f = TRUE;
+      break;
+
+    case OPT_PACKET:
+      packet_if = optarg;
+      break;
+
+    case OPT_QDISCBYPASS:
+      qdisc_bypass_f = TRUE;
+      break;
+
+    case OPT_DSTMAC:
+      dst_mac = optarg;
+      break;
+
+    case OPT_EXPORTERS:
+      nvex = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_EXPRATE:
+      vex_rate = optarg;
+      break;
+
+    case OPT_FLOWCACHE:
+      cache_size = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_NEWFLOWS:
+      new_flows = atof(optarg);
+      break;
+
+    case OPT_ACTIVE:
+      active_to = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_INACTIVE:
+      inactive_to = strtoul(optarg, NULL, 10);
+      break;
+
+    case OPT_SCENARIO:
+      scenario_file = optarg;
+      break;
+
+    case OPT_BENCH:
+      bench_out = optarg;
+      break;
+
+    case OPT_SWEEP:
+      sweep = optarg;
+      break;
+
+    case OPT_SWEEPSTEP:
+      sweep_step = atof(optarg);
+      if (sweep_step <= 1)
+	fatal("sweep-step must be more than 1");
+      break;
+
+    case OPT_SWEEPHOLD:
+      sweep_hold = atof(optarg);
+      if (sweep_hold <= 0)
+	fatal("sweep-hold must be positive");
+      break;
+
+    case OPT_SWEEPOUT:
+      sweep_out = optarg;
+      break;
+
+    case OPT_STATS:
+      stats_ivl = atof(optarg);
+      if (stats_ivl <= 0)
+	fatal("stats interval must be positive");
+      break;
+
+    case OPT_JSON:
+      json_f = TRUE;
+      break;
+
+    case OPT_LISTEN:
+      listen_f = TRUE;
+      break;
+
     case 'd':		/* XXX: make this optional arg */
       debug = atoi(optarg);
       break;
@@ -668,14 +5647,207 @@ int main(int argc, char **argv)
   if (argc != 1)
     usage();
 
+  /* the collector address is the one to listen on */
+  if (listen_f && !sweep) {
+    if (nworkers < 1)
+      fatal("threads must be 1 or more");
+    run_listen(*argv, port, cpu, stats_ivl);
+    return 0;
+  }
+
+  /* a sweep is a profile of steps going up */
+  if (sweep) {
+    if (pc.rate > 0 || rate_prof_spec)
+      fatal("sweep sets the rate by itself");
+    if (count || stats_ivl > 0)
+      fatal("sweep runs until the knee and reports by itself");
+    if (listen_f && (nf_version != NF_VERSION_V5 || tcp_f || nosend_f ||
+		     pcap_out || packet_if))
+      fatal("listen with sweep receives version 5 over UDP only");
+    sweep_prof(&rate_prof, parse_rate_val(sweep, &pc.unit), sweep_step,
+	       sweep_hold);
+    if (rate_prof.r[0] <= 0)
+      fatal("invalid rate");
+  } else if (rate_prof_spec) {
+    if (pc.rate > 0)
+      fatal("rate and rate-profile are exclusive");
+    parse_rate_prof(rate_prof_spec, &rate_prof, &pc.unit);
+    if (stats_ivl == 0)
+      stats_ivl = 1;	/* to see it keep to the profile */
+  }
+  /* the pacer runs on the peak of the profile as far as the rest goes */
+  if (sweep || rate_prof_spec) {
+    for (i=0; i < rate_prof.npts; i++)
+      if (rate_prof.r[i] > pc.rate)
+	pc.rate = rate_prof.r[i];
+    pc.prof = &rate_prof;
+  }
+
+  if (nf_version != NF_VERSION_V5 && nf_version != NF_VERSION_V9 &&
+      nf_version != NF_VERSION_IPFIX)
+    fatal("version must be 5, 9 or 10");
+  if (field_list && nf_version == NF_VERSION_V5)
+    fatal("fields can be chosen only with version 9 or 10");
+  if (mtu < 576 || mtu > MAX_MTU)
+    fatal("mtu must be between 576 and 65535");
+  if (tcp_f && nf_version != NF_VERSION_IPFIX)
+    fatal("tcp is only for version 10 (IPFIX)");
+  if (tcp_f && (pcap_out || packet_if))
+    fatal("pcap-out and packet send UDP only");
+  if (pcap_out && packet_if)
+    fatal("pcap-out and packet cannot be used together");
+  if (spoofed_addr && !pcap_out && !packet_if)
+    fatal("spoof needs packet or pcap-out, which build the IP header");
+  if (uring_f && (tcp_f || pcap_out || packet_if || pool_size))
+    fatal("uring cannot be used with tcp, pcap-out, packet or pool");
+#if !defined (__linux__)
+  if (packet_if || uring_f)
+    fatal("packet and uring are available on Linux only");
+#endif
+
+  tmpl_refresh_pdus = strtol(tmpl_refresh, &p, 10);
+  if (*p == 's') {
+    tmpl_refresh_ns = (u_int64_t)tmpl_refresh_pdus * 1000000000ULL;
+    tmpl_refresh_pdus = 0;
+  }
+  if (tmpl_refresh_pdus < 0 || (!tmpl_refresh_pdus && !tmpl_refresh_ns) ||
+      (*p && strcmp(p, "s") != 0))
+    fatal("template-refresh must be a # of packets, or seconds with 's'");
+
+  /* a PDU with the template in it must still fit in a datagram */
+  layout_record(field_list);
+  if (nf_version == NF_VERSION_V5) {
+    max_flowrec = (mtu - IP_UDP_HDRLEN - layout.hdrlen) / layout.reclen;
+    if (max_flowrec > NF5_MAX_FLOWREC)
+      max_flowrec = NF5_MAX_FLOWREC;
+  } else
+    max_flowrec = (mtu - IP_UDP_HDRLEN - layout.hdrlen - tset_len -
+		   sizeof(struct nf_v9_set_hdr) - 3) / layout.reclen;
+  if (flowrec_count == 0)
+    flowrec_count = max_flowrec;
+  if (flowrec_count < 1 || flowrec_count > max_flowrec) {
+    fprintf(stderr, "flowrec must be between 1 and %u\n", max_flowrec);
+    exit(1);
+  }
+
+  if (batch_size < 1 || batch_size > MAX_BATCH)
+    fatal("batch must be between 1 and 1024");
+
+  if (nworkers < 1)
+    fatal("threads must be 1 or more");
+
+  /* virtual exporters are paced by their own rates */
+  if (nvex && (pc.rate > 0 || wait_f || pool_size))
+    fatal("exporters cannot be used with rate, wait or pool");
+  if (nvex > 65536)
+    fatal("exporters must be 65536 or less");
+
+  /* flows come and go at the rates of the flow cache */
+  if (cache_size && (pc.rate > 0 || wait_f || pool_size || nvex))
+    fatal("flow-cache cannot be used with rate, wait, pool or exporters");
+  if (cache_size && (cache_size < (u_int32_t)nworkers || cache_size > 1U << 30))
+    fatal("flow-cache must be between # of threads and 2^30");
+  if (cache_size && (new_flows <= 0 || active_to < 1 || inactive_to < 1 ||
+		     active_to > 86400 || inactive_to > 86400))
+    fatal("new-flows and the timeouts (1 sec to 1 day) must be positive");
+
+  if (bench_out && (nworkers > 1 || tcp_f || pcap_out || packet_if ||
+		    uring_f || nvex || cache_size))
+    fatal("bench cannot be used with threads, tcp, pcap-out, packet, "
+	  "uring, exporters or flow-cache");
+
+  /* the PDUs of a capture come as they are, at its timing */
+  if (pcap_in && (nf_version != NF_VERSION_V5 || field_list))
+    fatal("pcap-in replays version 5 only");
+  if (pcap_in && (wait_f || pool_size || nvex || cache_size ||
+		  scenario_file || bench_out))
+    fatal("pcap-in cannot be used with wait, pool, exporters, flow-cache, "
+	  "scenario or bench");
+  if (pcap_in && pin.speed > 0 && pc.rate > 0)
+    fatal("pcap-in takes rate only with pcap-speed 0");
+
+  /* a PDU must not be patched again while it is still in the batch */
+  if (pool_size < 0 || (pool_size && pool_size / nworkers < batch_size))
+    fatal("pool must have as many PDUs as batch for every thread");
+
+  simd_init(nosimd_f);
+
   if (1) {
     printf("collector = %s\n",  *argv);
     printf("count     = %lu\n", count);
     printf("spoof     = %s\n",  spoofed_addr ? spoofed_addr : "(none)");
     printf("port      = %d\n",  port);
+    printf("version   = %d\n",  nf_version);
+    if (nf_version != NF_VERSION_V5) {
+      printf("fields    = %s\n",  field_list ? field_list : "(all)");
+      if (tcp_f)
+	printf("template  = once (tcp)\n");
+      else
+	printf("template  = every %s%s\n", tmpl_refresh,
+	       tmpl_refresh_ns ? "" : " packets");
+    }
+    printf("mtu       = %d%s\n", mtu, tcp_f ? " (tcp)" : "");
     printf("wait      = %s (msec)\n",  wait);
     printf("interval  = %s\n",  interval);
     printf("flowrec   = %u\n",  flowrec_count);
+    if (sweep)
+      printf("rate      = sweep from %.0f %s/sec, x%g every %g sec "
+	     "(spin %lu usec)\n", rate_prof.r[0],
+	     pc.unit == RATE_FLOWS ? "flows" :
+	     pc.unit == RATE_PDUS ? "PDUs" : "bits", sweep_step, sweep_hold,
+	     (unsigned long)(pc.spin_ns / 1000));
+    else if (pc.prof)
+      printf("rate      = %s, %d points%s, up to %.0f %s/sec "
+	     "(spin %lu usec)\n", rate_prof_spec, rate_prof.npts,
+	     rate_prof.loop_f ? " looping" : "", pc.rate,
+	     pc.unit == RATE_FLOWS ? "flows" :
+	     pc.unit == RATE_PDUS ? "PDUs" : "bits",
+	     (unsigned long)(pc.spin_ns / 1000));
+    else if (pc.rate > 0)
+      printf("rate      = %.0f %s/sec (spin %lu usec)\n", pc.rate,
+	     pc.unit == RATE_FLOWS ? "flows" :
+	     pc.unit == RATE_PDUS ? "PDUs" : "bits",
+	     (unsigned long)(pc.spin_ns / 1000));
+    printf("batch     = %d%s\n", batch_size, uring_f ? " (io_uring)" :
+	   (batch_size > 1 && gso_f) ? " (gso)" : "");
+    printf("threads   = %d\n",  nworkers);
+    printf("cpu       = %s\n",  cpu ? cpu : "(any)");
+    printf("seed      = %llu\n", (unsigned long long)rng_seed);
+    printf("simd      = %s\n",  simd.name);
+    printf("clock     = %s",  coarse_clock_f ? "coarse" : "monotonic");
+    if (time_warp > 0 || start_time)
+      printf(" (virtual, %gx from %s)", time_warp > 0 ? time_warp : 1,
+	     start_time ? start_time : "now");
+    printf("\n");
+    if (pool_size)
+      printf("pool      = %ld PDUs\n", pool_size);
+    if (pcap_out)
+      printf("pcap_out  = %s%s\n", pcap_out, nworkers > 1 ? ".<thread>" : "");
+    if (pcap_in) {
+      if (pin.speed > 0)
+	printf("pcap_in   = %s (%gx the original timing)\n", pcap_in,
+	       pin.speed);
+      else
+	printf("pcap_in   = %s (as fast as possible)\n", pcap_in);
+    }
+    if (packet_if)
+      printf("packet    = %s (tx ring%s)\n", packet_if,
+	     qdisc_bypass_f ? ", qdisc bypass" : "");
+    if (nvex)
+      printf("exporters = %u (%s flows/sec each)\n", nvex, vex_rate);
+    if (cache_size)
+      printf("cache     = %u flows, %g new/sec, timeouts %u/%u sec\n",
+	     cache_size, new_flows, active_to, inactive_to);
+    if (scenario_file)
+      printf("scenario  = %s (reloaded on SIGHUP)\n", scenario_file);
+    if (bench_out)
+      printf("bench     = %s\n", bench_out);
+    if (stats_ivl > 0)
+      printf("stats     = every %g sec%s\n", stats_ivl,
+	     json_f ? " (json)" : "");
+    if (sweep)
+      printf("sweep     = %s%s%s\n", sweep_out ? sweep_out : "(stdout only)",
+	     listen_f ? ", listening on " : "", listen_f ? *argv : "");
     printf("debug     = %d\n",  debug);
     printf("eng_type  = %s\n",  engine_type);
     printf("eng_id    = %s\n",  engine_id);
@@ -699,86 +5871,165 @@ int main(int argc, char **argv)
     printf("dst_mask  = %s\n",  dst_mask);
   }
 
-  init_exporter(*argv, port, flowrec_count);
-
-  compile_expr(wait, &wait_exp);
-  compile_expr(interval, &intvl_exp);
-  compile_expr(engine_type, &Ex.engine_type);
-  compile_expr(engine_id, &Ex.engine_id);
-
-  compile_ipaddr_expr(src_addr, &srcaddr_exp);
-  compile_ipaddr_expr(dst_addr, &dstaddr_exp);
-  compile_ipaddr_expr(nexthop,  &nhop_exp);
-
-  compile_expr(in_if, &iif_exp);
-  compile_expr(out_if, &oif_exp);
-  compile_expr(packets, &pkt_exp);
-  compile_expr(octets, &oct_exp);
-  compile_expr(first, &fseen_exp);
-  compile_expr(last, &lseen_exp);
-  compile_expr(src_port, &srcp_exp);
-  compile_expr(dst_port, &dstp_exp);
-  compile_expr(tcp_flags, &tcpf_exp);
-  compile_expr(proto, &proto_exp);
-  compile_expr(tos, &tos_exp);
-  compile_expr(src_as, &srcas_exp);
-  compile_expr(dst_as, &dstas_exp);
-  compile_expr(src_mask, &srcmask_exp);
-  compile_expr(dst_mask, &dstmask_exp);
+  /* the main thread's own stream, e.g. for a random cpu expression */
+  rng_init(rng_seed, nworkers);
 
-  while (1) {
-    char ip_addr[sizeof("XXX.XXX.XXX.XXX")];
-
-    memset(&fi, 0, sizeof(fi));		/* XXX init */
-
-    expr_addr(ip_addr, &srcaddr_exp);
-    inet_aton(ip_addr, &fi.src_addr);
-    expr_addr(ip_addr, &dstaddr_exp);
-    inet_aton(ip_addr, &fi.dst_addr);
-    expr_addr(ip_addr, &nhop_exp);
-    inet_aton(ip_addr, &fi.nexthop);
-    fi.in_if     = (u_int16_t)expr_val(&iif_exp);
-    fi.out_if    = (u_int16_t)expr_val(&oif_exp);
-    fi.packets   = (u_int32_t)expr_val(&pkt_exp);
-    fi.octets    = (u_int32_t)expr_val(&oct_exp);
-
-    ut = sysuptime();
-    fi.last      = ut - (u_int32_t)expr_val(&lseen_exp);
-    fi.first     = fi.last - (u_int32_t)expr_val(&fseen_exp);
-
-    fi.src_port  = (u_int16_t)expr_val(&srcp_exp);
-    fi.dst_port  = (u_int16_t)expr_val(&dstp_exp);
-    fi.tcp_flags = (u_int8_t)expr_val(&tcpf_exp);
-    fi.ip_proto  = (u_int8_t)expr_val(&proto_exp);
-    fi.tos       = (u_int8_t)expr_val(&tos_exp);
-    fi.src_as    = (u_int16_t)expr_val(&srcas_exp);
-    fi.dst_as    = (u_int16_t)expr_val(&dstas_exp);
-    fi.src_mask  = (u_int8_t)expr_val(&srcmask_exp);
-    fi.dst_mask  = (u_int8_t)expr_val(&dstmask_exp);
-
-    add_flow(&fi);
-
-    if (wait_f) {
-      struct timespec req;
-      unsigned long w;
+  compile_expr(wait, &fx.wait);
+  compile_expr(interval, &fx.intvl);
+  compile_expr(engine_type, &engine_type_exp);
+  compile_expr(engine_id, &engine_id_exp);
+  if (cpu)
+    compile_expr(cpu, &cpu_exp);
+  compile_expr(vex_rate, &vex_rate_exp);
+  if (spoofed_addr)
+    compile_ipaddr_expr(spoofed_addr, &spoof_exp);
 
-      if ((n % expr_val(&intvl_exp)) == 0) {
-	w = (unsigned long)expr_val(&wait_exp);
-	req.tv_sec = (w * 1000 * 1000) / 1000000000;
-	req.tv_nsec = (w * 1000 * 1000) % 1000000000;
-	if (nanosleep(&req, NULL) == -1)
-	  perror("nanosleep");
-      }
+  compile_ipaddr_expr(src_addr, &fx.srcaddr);
+  compile_ipaddr_expr(dst_addr, &fx.dstaddr);
+  compile_ipaddr_expr(nexthop,  &fx.nexthop);
+
+  compile_expr(in_if, &fx.in_if);
+  compile_expr(out_if, &fx.out_if);
+  compile_expr(packets, &fx.packets);
+  compile_expr(octets, &fx.octets);
+  compile_expr(first, &fx.first);
+  compile_expr(last, &fx.last);
+  compile_expr(src_port, &fx.src_port);
+  compile_expr(dst_port, &fx.dst_port);
+  compile_expr(tcp_flags, &fx.tcp_flags);
+  compile_expr(proto, &fx.proto);
+  compile_expr(tos, &fx.tos);
+  compile_expr(src_as, &fx.src_as);
+  compile_expr(dst_as, &fx.dst_as);
+  compile_expr(src_mask, &fx.src_mask);
+  compile_expr(dst_mask, &fx.dst_mask);
+
+  clock_init(coarse_clock_f, start_ns, time_warp);
+  /* rates are of the virtual clock too */
+  if (time_warp > 0) {
+    pc.rate *= time_warp;
+    for (i=0; pc.prof && i < rate_prof.npts; i++) {
+      rate_prof.t[i] /= time_warp;
+      rate_prof.r[i] *= time_warp;
     }
+  }
 
-    n++;
-    if (!count)
-      continue;
-    else if (n >= count)
-      break;
+  if ((Ex = calloc(nworkers, sizeof(struct flow_exporter))) == NULL)
+    fatal("out of memory");
+  if (pcap_in)
+    pcap_in_open(&pin, pcap_in);
+
+  /*
+   * Each worker gets its own socket and copy of the expressions. The
+   * flow count and the target rate are divided among them, and the
+   * wait is stretched so that the aggregated rate stays the same as
+   * with a single worker.
+   */
+  for (i=0; i < nworkers; i++) {
+    struct flow_exporter *ex = &Ex[i];
+
+    init_exporter(ex, *argv, port, flowrec_count, batch_size, gso_f);
+    ex->id = i;
+    ex->cpu = cpu ? (int)expr_val(&cpu_exp) : -1;
+    ex->count = count / nworkers + (i < count % nworkers ? 1 : 0);
+    if (pool_size)
+      ex->pool_size = pool_size / nworkers + (i < pool_size % nworkers ? 1 : 0);
+    ex->wait_f = wait_f;
+    ex->wait_scale = nworkers;
+    memcpy(&ex->pc, &pc, sizeof(pc));
+    ex->pc.rate /= nworkers;
+    ex->pc.shares = nworkers;
+    memcpy(&ex->base.fx, &fx, sizeof(fx));
+    memcpy(&ex->engine_type, &engine_type_exp, sizeof(val_expr_t));
+    memcpy(&ex->engine_id, &engine_id_exp, sizeof(val_expr_t));
+    ex->spoof_f = (spoofed_addr != NULL);
+    if (ex->spoof_f)
+      memcpy(&ex->spoof, &spoof_exp, sizeof(spoof_exp));
+    ex->nvex = nvex / nworkers + (i < nvex % nworkers ? 1 : 0);
+    if (ex->nvex)
+      init_vexporters(ex, vex_base, &vex_rate_exp, &engine_type_exp,
+		      &engine_id_exp, spoofed_addr ? &spoof_exp : NULL);
+    vex_base += ex->nvex;
+    compile_record(ex);
+    if (pcap_in) {
+      ex->pin = &pin;
+      if ((ex->pin_seq = calloc(1 << 16, sizeof(u_int32_t))) == NULL)
+	fatal("out of memory");
+    }
+    if (cache_size)
+      cache_init(ex, cache_size / nworkers, new_flows / nworkers,
+		 active_to * 1000, inactive_to * 1000);
+    ex->pcap_fd = -1;
+    if (pcap_out)
+      pcap_open(ex, pcap_out);
+    ex->ring_fd = -1;
+#if defined (__linux__)
+    if (packet_if)
+      ring_open(ex, packet_if, dst_mac, qdisc_bypass_f);
+    if (uring_f)
+      uring_open(ex);
+#endif
   }
 
-  flush_flow();
+  memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_handler = interrupt;
+  sigaction(SIGINT, &sigact, NULL);
+  if (scenario_file) {
+    memcpy(&scenario_fx, &fx, sizeof(fx));
+    load_scenario(FALSE);
+    sigact.sa_handler = hangup;
+    sigaction(SIGHUP, &sigact, NULL);
+  }
+
+  /* a collector closing the TCP session makes writev() fail instead */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (bench_out) {
+    bench(bench_out);
+    return 0;
+  }
+
+  /* with the sweep, the listeners receive what the workers send */
+  if (sweep && listen_f)
+    open_listeners(*argv, port, cpu);
+
+  /* SIGINT and SIGHUP should be delivered to the main thread only */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  if (scenario_file)
+    sigaddset(&sigs, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  if (Lx)
+    start_listeners();
+  for (i=0; i < nworkers; i++) {
+    if (count && Ex[i].count == 0) {
+      Ex[i].done_f = TRUE;
+      continue;		/* more workers than flows */
+    }
+    if ((errno = pthread_create(&Ex[i].thread, NULL,
+				run_exporter, &Ex[i])) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+  if (sweep)
+    run_sweep(&rate_prof, sweep_out);
+  else if (stats_ivl > 0)
+    report_stats((u_int64_t)(stats_ivl * 1e9));
+  else if (scenario_file)
+    watch_scenario();
+
+  for (i=0; i < nworkers; i++)
+    if (!count || Ex[i].count)
+      pthread_join(Ex[i].thread, NULL);
+  for (i=0; Lx && i < nworkers; i++)
+    pthread_join(Lx[i].thread, NULL);
+
+  cleanup();
 
   if (debug)
     printf("%lu flow(s) generated\n", count);
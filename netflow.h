@@ -21,22 +21,44 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <pthread.h>
 
 #define EXPR_TYPE_SEQ	1	/* Sequential */
 #define EXPR_TYPE_RND	2	/* Random */
 #define EXPR_TYPE_PRB	3	/* Probabilistic */
+#define EXPR_TYPE_ZIPF	4	/* Zipf: ranks from start on, by alias table */
+#define EXPR_TYPE_PARETO 5	/* Pareto */
+#define EXPR_TYPE_LOGNORM 6	/* Lognormal */
+
+#define ZIPF_MAX	(1 << 24)	/* ranks of a Zipf expression */
 
 typedef struct val_expr {
-  int mode;		/* EXPR_TYPE_SEQ, EXPR_TYPE_RND or EXPR_TYPE_PRB */
+  int mode;		/* EXPR_TYPE_* */
   long start;		/* inclusive */
   long end;		/* inclusive */
   long step;
-  long vals[100];
+  int nvals;		/* EXPR_TYPE_PRB, _ZIPF: # of values */
+  long *vals;		/* EXPR_TYPE_PRB: values */
+  u_int64_t *prob;	/* EXPR_TYPE_PRB, _ZIPF: alias table, scaled to 2^32 */
+  u_int32_t *alias;	/* EXPR_TYPE_PRB, _ZIPF: alias table */
+  double p1, p2;	/* EXPR_TYPE_PARETO: xm, -1/alpha; _LOGNORM: mu, sigma */
   long cur;
 } val_expr_t;
 
+#define ADDR_TYPE_OCTET	1	/* an expression for each octet */
+#define ADDR_TYPE_SEQ	2	/* sequential over a 32-bit range */
+#define ADDR_TYPE_RND	3	/* random over a 32-bit range */
+#define ADDR_TYPE_ZIPF	4	/* Zipf over a prefix, exp[0] draws it */
+
 typedef struct ipaddr_expr {
-  val_expr_t exp[4];
+  int mode;		/* ADDR_TYPE_* */
+  u_int32_t start;	/* inclusive, in host byte order */
+  u_int32_t end;	/* inclusive, in host byte order */
+  u_int32_t step;
+  u_int32_t cur;
+  val_expr_t exp[4];	/* ADDR_TYPE_OCTET, exp[0] of ADDR_TYPE_ZIPF */
 } ipaddr_expr_t;
 
 #define TRUE	1
@@ -49,11 +71,18 @@ typedef struct ipaddr_expr {
 #define NF_VERSION_V7	7
 #define NF_VERSION_V8	8
 #define NF_VERSION_V9	9
+#define NF_VERSION_IPFIX	10
 
 /* (1500 - 20 - 8 - 24) / 48 = 30 flow records */
 #define NF5_MAX_FLOWREC 30
 
-#define MAX_FLOW_INFO	NF5_MAX_FLOWREC
+
+/* max # of PDUs handed to the kernel by one sendmmsg() (UIO_MAXIOV) */
+#define MAX_BATCH	1024
+
+/* UDP GSO limits: 64 segments and 64KB per super-packet */
+#define GSO_MAX_SEGS	64
+#define GSO_MAX_BYTES	(65535 - 20 - 8)
 
 struct nf_v5_hdr {	/*  24 octets */
   u_int16_t version;		/* 5 */
@@ -61,7 +90,7 @@ struct nf_v5_hdr {	/*  24 octets */
   u_int32_t sysup_time;
   u_int32_t unix_secs;
   u_int32_t unix_nsecs;
-  u_int32_t flow_sequence;   /* # of total flows seen (this differs in V9) */
+  u_int32_t flow_sequence;   /* # of flows exported before (this differs in V9) */
   u_int8_t engine_type;	     /* 0: RP, 1: VIP/LC */
   u_int8_t engine_id;
   u_int16_t sampling;
@@ -95,30 +124,370 @@ struct nf_v5_pdu {
   struct nf_v5_rec rec[NF5_MAX_FLOWREC];
 };
 
-struct flow_info {
-  struct in_addr src_addr;
-  struct in_addr dst_addr;
-  struct in_addr nexthop;
-  u_int16_t in_if;
-  u_int16_t out_if;
-  u_int32_t packets;
-  u_int32_t octets;
-  u_int32_t first;
-  u_int32_t last;
-  u_int16_t src_port;
-  u_int16_t dst_port;
-  u_int8_t pad1;
-  u_int8_t tcp_flags;
-  u_int8_t ip_proto;
-  u_int8_t tos;
-  u_int16_t src_as;
-  u_int16_t dst_as;
-  u_int8_t src_mask;
-  u_int8_t dst_mask;
+struct nf_v9_hdr {	/* 20 octets */
+  u_int16_t version;		/* 9 */
+  u_int16_t count;		/* # of records, templates included */
+  u_int32_t sysup_time;
+  u_int32_t unix_secs;
+  u_int32_t package_sequence;	/* # of PDUs sent before */
+  u_int32_t source_id;
+};
+
+struct nf_v9_set_hdr {	/* FlowSet header */
+  u_int16_t id;		/* NF9_TEMPLATE_SET or a template ID */
+  u_int16_t length;	/* octets, this header and padding included */
+};
+
+#define NF9_TEMPLATE_SET	0
+#define NF9_TEMPLATE_ID		256	/* the one template we export */
+
+struct ipfix_hdr {	/* 16 octets */
+  u_int16_t version;		/* 10 */
+  u_int16_t length;		/* octets, this header included */
+  u_int32_t export_time;
+  u_int32_t sequence;		/* # of data records sent before */
+  u_int32_t domain_id;		/* observation domain */
+};
+
+/* IPFIX has the same sets as V9, but a different template set ID */
+#define IPFIX_TEMPLATE_SET	2
+
+/* largest PDU with --mtu; an IPFIX message length is 16 bits */
+#define MAX_MTU		65535
+
+/* NetFlow V9 field types, which are also the IPFIX information elements */
+#define NF9_IN_BYTES		1
+#define NF9_IN_PKTS		2
+#define NF9_PROTOCOL		4
+#define NF9_SRC_TOS		5
+#define NF9_TCP_FLAGS		6
+#define NF9_L4_SRC_PORT		7
+#define NF9_IPV4_SRC_ADDR	8
+#define NF9_SRC_MASK		9
+#define NF9_INPUT_SNMP		10
+#define NF9_L4_DST_PORT		11
+#define NF9_IPV4_DST_ADDR	12
+#define NF9_DST_MASK		13
+#define NF9_OUTPUT_SNMP		14
+#define NF9_IPV4_NEXT_HOP	15
+#define NF9_SRC_AS		16
+#define NF9_DST_AS		17
+#define NF9_LAST_SWITCHED	21
+#define NF9_FIRST_SWITCHED	22
+
+
+/* fields of a flow record */
+#define FIELD_SRCADDR	0
+#define FIELD_DSTADDR	1
+#define FIELD_NEXTHOP	2
+#define FIELD_INPUTIF	3
+#define FIELD_OUTPUTIF	4
+#define FIELD_PACKETS	5
+#define FIELD_OCTETS	6
+#define FIELD_FIRST	7
+#define FIELD_LAST	8
+#define FIELD_SRCPORT	9
+#define FIELD_DSTPORT	10
+#define FIELD_TCPFLAGS	11
+#define FIELD_PROTOCOL	12
+#define FIELD_TOS	13
+#define FIELD_SRCAS	14
+#define FIELD_DSTAS	15
+#define FIELD_SRCMASK	16
+#define FIELD_DSTMASK	17
+#define NUM_FIELDS	18
+
+#define MAX_RECLEN	128
+
+/* template FlowSet with a single template of all the fields */
+#define MAX_TSETLEN	(4 + 4 + NUM_FIELDS * 4)
+
+/* max # of values evaluated at once for a field */
+#define COL_MAX		1024
+
+/* where each field goes in an encoded flow record */
+struct rec_layout {
+  int hdrlen;		/* octets before the first record in a PDU */
+  int reclen;		/* octets per record */
+  int off[NUM_FIELDS];	/* offset in a record, -1 if not exported */
+  int width[NUM_FIELDS];	/* 1, 2 or 4 octets */
+};
+
+/* a field which has to be evaluated for every flow record */
+struct rec_field {
+  val_expr_t *val;	/* either one of them */
+  ipaddr_expr_t *addr;
+  int off;
+  int width;
+};
+
+/* compiled flowrec-options; every worker has its own copy (and cursors) */
+struct flow_exprs {
+  val_expr_t wait;
+  val_expr_t intvl;
+  ipaddr_expr_t srcaddr;
+  ipaddr_expr_t dstaddr;
+  ipaddr_expr_t nexthop;
+  val_expr_t in_if;
+  val_expr_t out_if;
+  val_expr_t packets;
+  val_expr_t octets;
+  val_expr_t first;
+  val_expr_t last;
+  val_expr_t src_port;
+  val_expr_t dst_port;
+  val_expr_t tcp_flags;
+  val_expr_t proto;
+  val_expr_t tos;
+  val_expr_t src_as;
+  val_expr_t dst_as;
+  val_expr_t src_mask;
+  val_expr_t dst_mask;
+};
+
+/*
+ * Expressions of the flow records and what is compiled from them: those
+ * of the command line, or of a profile of the scenario (--scenario).
+ */
+struct flow_prof {
+  char name[32];
+  double weight;	/* share of the flows in the scenario */
+  u_int32_t own;	/* bit f: fields[f] is compiled from the scenario */
+  struct flow_exprs fx;
+  u_int8_t tmpl[MAX_RECLEN];	/* record with all the static fields set */
+  struct rec_field gen[NUM_FIELDS];	/* fields not in the template */
+  int ngen;
+};
+
+#define MAX_PROFILES	32
+
+/*
+ * A scenario as loaded from the file. Each worker draws from a copy of
+ * the profiles of its own; the last one to leave it frees it.
+ */
+struct scenario {
+  int nprof;
+  struct flow_prof *prof;
+  val_expr_t pick;	/* draws a profile # by the weights */
+  int users;		/* # of workers yet to leave it */
 };
 
+/* Ethernet + IPv4 + UDP headers of a synthesized frame */
+struct frame_hdr {
+  u_int8_t eth_dst[6];
+  u_int8_t eth_src[6];
+  u_int16_t eth_type;
+  u_int8_t ip_vhl;
+  u_int8_t ip_tos;
+  u_int16_t ip_len;
+  u_int16_t ip_id;
+  u_int16_t ip_off;
+  u_int8_t ip_ttl;
+  u_int8_t ip_p;
+  u_int16_t ip_sum;
+  u_int32_t ip_src;
+  u_int32_t ip_dst;
+  u_int16_t uh_sport;
+  u_int16_t uh_dport;
+  u_int16_t uh_ulen;
+  u_int16_t uh_sum;
+} __attribute__((packed));
+
+#define ETHERTYPE_IPV4	0x0800
+
+/* pcap file format, with nanosecond timestamps */
+#define PCAP_MAGIC_NSEC	0xa1b23c4d
+#define PCAP_MAGIC_USEC	0xa1b2c3d4
+#define PCAP_LINKTYPE_NULL	0	/* BSD loopback */
+#define PCAP_LINKTYPE_ETHERNET	1
+#define PCAP_LINKTYPE_RAW	101	/* IPv4 or IPv6, no link header */
+#define PCAP_LINKTYPE_SLL	113	/* Linux "any" */
+#define PCAP_LINKTYPE_SLL2	276
+
+struct pcap_file_hdr {
+  u_int32_t magic;
+  u_int16_t version_major;	/* 2 */
+  u_int16_t version_minor;	/* 4 */
+  int32_t thiszone;
+  u_int32_t sigfigs;
+  u_int32_t snaplen;
+  u_int32_t linktype;
+};
+
+struct pcap_pkt_hdr {
+  u_int32_t ts_sec;
+  u_int32_t ts_frac;	/* nsec or usec, depending on the magic */
+  u_int32_t caplen;
+  u_int32_t len;
+};
+
+/* pcap output is written in chunks of this size */
+#define PCAP_BUFSIZE	(4 << 20)
+
+/*
+ * A capture of NetFlow V5 exports to replay (--pcap-in), mapped into
+ * memory and shared by all the workers.
+ */
+struct pcap_in {
+  const u_int8_t *map;
+  size_t size;
+  int swap_f;		/* written on a host of the other byte order */
+  int nsec_f;		/* nanosecond time stamps */
+  u_int32_t linktype;
+  double speed;		/* of the original timing, 0 = as fast as possible */
+  u_int64_t *pos;	/* how far each worker has got, over all the passes */
+};
+
+/* pages of the capture already replayed are let go in chunks of this */
+#define PCAP_IN_CHUNK	(64 << 20)
+
+/* # of frames in an AF_PACKET TX ring */
+#define TX_RING_FRAMES	1024
+
+/* io_uring: # of batches in flight, and the PDU size sent with zero copy */
+#define URING_GROUPS	4
+#define URING_ZC_MIN	4096
+
+#if defined (__linux__)
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  int zc_f;		/* the kernel knows IORING_OP_SEND_ZC (probed) */
+  int fixed_f;		/* the PDU slots are a registered buffer */
+  u_int8_t *slots;	/* URING_GROUPS groups of batch_size PDU slots */
+  size_t slots_len;
+  int group;		/* group being filled */
+  int pending[URING_GROUPS];	/* completions yet to come for each group */
+  long errs;		/* sends failed */
+  int last_err;		/* errno of the last failure */
+};
+#endif
+
+#define RATE_FLOWS	0	/* flows per second */
+#define RATE_PDUS	1	/* PDUs per second */
+#define RATE_BITS	2	/* bits per second at the IP layer */
+
+/* IPv4 + UDP headers, counted for RATE_BITS */
+#define IP_UDP_HDRLEN	(20 + 8)
+
+/*
+ * A target rate which changes over time (--rate-profile): linear from
+ * point to point, and over again from the first one after the last one
+ * if it loops.
+ */
+struct rate_prof {
+  int npts;
+  double *t;		/* sec since the start, not decreasing, from 0 */
+  double *r;		/* rate at t in units/sec */
+  int loop_f;
+};
+
+struct pacer {
+  int unit;		/* RATE_FLOWS, RATE_PDUS or RATE_BITS */
+  double rate;		/* target rate in units/sec, 0 = unlimited */
+  struct rate_prof *prof;	/* or the rate over time, rate its peak */
+  int shares;		/* the worker's share of the profile is 1/shares */
+  int seg;		/* segment of the profile the pacer is in */
+  double pos;		/* sec into the profile the pacer is at */
+  double base;		/* sec of the loops of the profile gone by */
+  int end_f;		/* the profile has run out */
+  u_int64_t spin_ns;	/* busy-wait this long before a deadline */
+  u_int64_t t0;		/* time pacing started (CLOCK_MONOTONIC, ns) */
+  double units;		/* units released so far */
+  u_int64_t last;	/* time the last batch was released */
+  u_int64_t last_deadline;	/* when it was due */
+  double last_cost;	/* units in the last batch */
+  long gaps;		/* # of inter-PDU gaps measured */
+  double dev_sum;	/* sum of (gap - ideal gap) in ns */
+  double dev_sq;	/* sum of (gap - ideal gap)^2 */
+  double dev_max;	/* max |gap - ideal gap| */
+};
+
+/*
+ * An exporter as the collector sees it. A worker is a single one of
+ * them, unless it emulates many (--exporters), which then take turns
+ * on its socket as a timer wheel tells.
+ */
+struct vexporter {
+  u_int32_t flows;	/* # of flow records exported, for the sequence */
+  u_int32_t pdus;	/* # of PDUs exported, for V9 package_sequence */
+  u_int32_t up_off;	/* msec added to sysuptime(): its own boot time */
+  u_int32_t source_id;	/* V9 source_id, IPFIX observation domain */
+  u_int8_t engine_type;
+  u_int8_t engine_id;
+  u_int32_t src_addr;	/* spoofed source address, network byte order */
+  int k;		/* # of flow records in each PDU */
+  long tmpl_pdus;	/* # of PDUs since the template was last sent */
+  u_int64_t tmpl_last;	/* time the template was last sent, 0 = never */
+  u_int64_t period;	/* nsec between PDUs */
+  u_int64_t due;	/* time the next PDU is due (CLOCK_MONOTONIC, ns) */
+  u_int32_t next;	/* next one in the same wheel slot */
+};
+
+/* timer wheel of virtual exporters; no period is longer than a second */
+#define WHEEL_TICK	1000000		/* nsec */
+#define WHEEL_SIZE	2048		/* slots, a power of 2 */
+#define VEX_NIL		0xffffffffU
+
+/*
+ * A flow in the flow cache (--flow-cache). Its packets are spread
+ * evenly from its start till end; those not exported yet are counted
+ * in pkts and octs, from exp on. It is followed by its key: the flow
+ * record without the counters and time stamps.
+ */
+struct cflow {
+  u_int32_t next;	/* next one in the same wheel slot, or on free list */
+  u_int32_t exp;	/* msec exported up to */
+  u_int32_t end;	/* msec of its last packet */
+  u_int32_t pkts;	/* packets not exported yet */
+  u_int32_t octs;	/* octets not exported yet */
+};
+
+#define CACHE_TICK	10		/* msec */
+#define CACHE_NIL	0xffffffffU
+
+struct flow_cache {
+  u_int32_t size;	/* max # of flows */
+  u_int32_t nflows;	/* # of flows in it */
+  u_int32_t free;	/* list of free entries */
+  u_int8_t *flows;	/* size entries of stride octets */
+  size_t stride;
+  u_int32_t *index;	/* open addressing by key, CACHE_NIL = empty */
+  u_int32_t mask;	/* index has mask + 1 slots */
+  u_int32_t *wheel;	/* a list of flows due in each tick */
+  u_int32_t wmask;	/* wheel has wmask + 1 slots */
+  int cut;		/* where the counters are cut out of the record */
+  int cutlen;
+  int keylen;
+  u_int8_t *scratch;	/* COL_MAX records of new flows */
+  double rate;		/* new flows/sec */
+  u_int32_t active;	/* active timeout (msec) */
+  u_int32_t inactive;	/* inactive timeout (msec) */
+  u_int32_t now;	/* msec since the cache was started */
+  u_int32_t up0;	/* sysuptime when it was started */
+  u_int32_t pdu_start;	/* msec the PDU being filled was started */
+  u_int64_t born;	/* # of new flows so far */
+  long drops;		/* new flows which found the cache full */
+};
 
 struct flow_exporter {
+  int id;		/* worker number */
+  pthread_t thread;
+  int cpu;		/* CPU to pin this worker to, or -1 */
+  unsigned long count;	/* # of flows to generate, 0 = infinite */
+  int wait_f;
+  int wait_scale;	/* wait is stretched by this to split the rate */
+  struct flow_prof base;	/* flow records of the command line */
+  int nmix;		/* # of profiles of the scenario, 0 = just base */
+  struct flow_prof *mix;	/* own copy of the scenario's profiles */
+  val_expr_t pick;
+  struct scenario *scn;	/* the scenario in use */
+  struct scenario *next_scn;	/* one to switch to, from the main thread */
   struct in_addr collector;	/* address of collector */
   u_int16_t port;
   int sock;
@@ -128,7 +497,120 @@ struct flow_exporter {
   val_expr_t engine_id;
   long flow_seen;	/* accumulative number of flow record seen */
   long pdu_sent;	/* accumulative number of flow PDU sent */
-  int flow_cnt;		/* # of flow_info occupied */
-  int bucket_size;	/* when flow_cnt reaches bucket_size, flow_info will be flushed */
-  struct flow_info fi[MAX_FLOW_INFO];
+  int flow_cnt;		/* # of records in the PDU being filled */
+  int bucket_size;	/* when flow_cnt reaches bucket_size, the PDU will be flushed */
+  struct rec_layout lay;
+  int rec_off;		/* where the records of the PDU being filled start */
+  int tmpl_f;		/* the PDU being filled carries the template */
+  struct vexporter self;	/* the exporter this worker is by default */
+  struct vexporter *vx;	/* the one the PDU being filled is from */
+  u_int32_t nvex;	/* # of virtual exporters, 0 = just self */
+  struct vexporter *vex;	/* nvex of them */
+  u_int32_t *wheel;	/* WHEEL_SIZE slots, each a list of vex[] */
+  int hdr_static;	/* engine_type and engine_id never change */
+  int batch_size;	/* # of PDUs queued before they are sent at once */
+  int batch_cnt;	/* # of PDUs queued */
+  size_t slot_size;	/* size of each PDU slot in batch_buf */
+  u_int8_t *batch_buf;	/* batch_size PDU slots */
+  struct iovec *iov;	/* one per PDU slot */
+  struct mmsghdr *msgs;	/* one per PDU slot */
+  int gso_f;		/* send a batch as UDP GSO super-packets */
+  int batch_flows;	/* # of flow records in the queued PDUs */
+  int pcap_fd;		/* pcap output, or -1 */
+  struct pcap_in *pin;	/* capture to replay, or NULL */
+  u_int32_t *pin_seq;	/* flow_sequence of each engine_type/engine_id */
+  u_int8_t *pcap_buf;	/* PCAP_BUFSIZE octets */
+  size_t pcap_used;
+  struct frame_hdr frame;	/* headers of the frames written out */
+  int spoof_f;		/* the frames carry spoofed source addresses */
+  ipaddr_expr_t spoof;
+  u_int32_t *src;	/* source address of each PDU slot, if spoofed */
+  u_int64_t *stamp;	/* clock each PDU slot was closed at (ns) */
+  int ring_fd;		/* AF_PACKET socket with a TX ring, or -1 */
+  u_int8_t *ring;
+  size_t ring_frame_size;
+  int ring_cur;		/* next frame to fill */
+  long ring_errs;	/* frames the kernel refused */
+  struct uring *ur;	/* io_uring backend, or NULL */
+  long pool_size;	/* # of pre-rendered PDUs, 0 = generate as we go */
+  u_int8_t *pool;	/* pool_size PDU slots */
+  u_int16_t *pool_len;	/* length of each pre-rendered PDU */
+  u_int16_t *pool_cnt;	/* # of flow records in each */
+  struct pacer pc;
+  struct flow_cache *fc;	/* flow cache, or NULL */
+  u_int64_t clk;		/* clock read at the start of the batch (ns) */
+  u_int64_t octets_sent;	/* accumulative PDU octets sent */
+  long err_nobufs;	/* sends failed with ENOBUFS */
+  long err_again;	/* sends failed with EAGAIN */
+  long err_other;	/* sends failed otherwise */
+  u_int64_t cpu_ns;	/* CPU time the worker took, once it has finished */
+  volatile int done_f;	/* the worker has finished */
+};
+
+/*
+ * Counters of a worker as the stats reporter last saw them. The worker
+ * just bumps its own, which the reporter reads without any locking.
+ */
+struct stats {
+  long flows;
+  long pdus;
+  u_int64_t octets;
+  long nobufs;
+  long again;
+  long errs;
+  double units;		/* released by the pacer */
+};
+
+/*
+ * --listen: a receiver standing in for a collector. Each thread reads
+ * a socket of its own (SO_REUSEPORT), and the kernel steers all the
+ * PDUs from a source address and port to the same one, so the sequence
+ * numbers of an exporter are tracked by a single thread.
+ */
+#define LISTEN_BATCH	64	/* PDUs taken by a recvmmsg() */
+#define LISTEN_STREAMS	(1 << 16)	/* exporters tracked by a thread */
+#define LISTEN_WINDOW	(1 << 20)	/* flows a late PDU may be behind */
+#define LISTEN_GAPS	8	/* gaps of an exporter a late PDU may fill */
+#define LISTEN_RESTART	4	/* PDUs going on behind to start over */
+
+struct lgap {		/* flows counted as lost, [lo, hi) */
+  u_int32_t lo;
+  u_int32_t hi;
+};
+
+struct lstream {	/* the V5 PDUs of an exporter */
+  u_int32_t addr;	/* source address, network byte order */
+  u_int16_t port;	/* source port, network byte order */
+  u_int8_t ngaps;
+  u_int8_t nredo;	/* PDUs in a row behind, outside any gap */
+  u_int32_t engine;	/* engine_type << 8 | engine_id, + 1; 0 = unused */
+  u_int32_t next;	/* flow_sequence expected next */
+  u_int32_t redo;	/* flow_sequence after the last of those */
+  struct lgap gaps[LISTEN_GAPS];	/* oldest first */
+};
+
+struct flow_listener {
+  pthread_t thread;
+  int id;
+  int cpu;
+  int sock;
+  u_int8_t *buf;
+  struct mmsghdr msgs[LISTEN_BATCH];
+  struct iovec iov[LISTEN_BATCH];
+  struct sockaddr_in from[LISTEN_BATCH];
+  struct lstream *streams;	/* open addressing, by source and engine */
+  u_int32_t nstreams;
+  /* counters, read by the main thread */
+  long flows;		/* flow records received */
+  long pdus;
+  u_int64_t octets;
+  long lost;		/* flows skipped by flow_sequence, less late ones */
+  long late;		/* PDUs which filled in a gap */
+  long dups;		/* PDUs behind, but not in a gap: duplicate or
+			   reordered before the first one */
+  long restarts;	/* exporters which started over */
+  long bad;		/* not V5, or truncated */
+  long skewed;		/* records with first > last, or last > sysup_time */
+  long untracked;	/* PDUs of exporters beyond LISTEN_STREAMS */
+  volatile int done_f;
 };